@@ -1,6 +1,18 @@
 #!/bin/bash
 BRANCH_EXT_ROOT=$(dirname $(realpath -s $0))
 
+# Compression of the trace: bz2 (default), zst or lz4
+COMPRESS=${3:-bz2}
+case ${COMPRESS} in
+  bz2) ;;
+  zst) FILTER="zstd -q -19 -c" ;;
+  lz4) FILTER="lz4 -q -9 -c" ;;
+  *)
+    echo "Unknown compression ${COMPRESS}, expected bz2, zst or lz4"
+    exit 1
+    ;;
+esac
+
 make -C ${BRANCH_EXT_ROOT}
 
 ${BRANCH_EXT_ROOT}/pin_tool/pin -t ${BRANCH_EXT_ROOT}/obj-intel64/branchExt.so -- $1
@@ -8,6 +20,18 @@ ${BRANCH_EXT_ROOT}/pin_tool/pin -t ${BRANCH_EXT_ROOT}/obj-intel64/branchExt.so -
 mv branches_0.out $2
 mv generalInfo_0.out "$2.txt"
 
-echo "bzip2 in progress - it may take a while"
+if [ ${COMPRESS} = bz2 ]; then
+  echo "bzip2 in progress - it may take a while"
+  bzip2 -f $2
+else
+  # Compress each 4MiB of the trace as an independent frame, so that
+  # the predictor can decode frames in parallel and seek between them
+  echo "${COMPRESS} compression in progress"
+  split -b 4M --filter="${FILTER}" $2 > $2.${COMPRESS} && rm -f $2
+fi
 
-bzip2 -f $2
\ No newline at end of file
+# Index the trace for --skip if the simulator has been built
+TRACECONV=${BRANCH_EXT_ROOT}/../src/traceconv
+if [ -x ${TRACECONV} ]; then
+  ${TRACECONV} --index $2.${COMPRESS}
+fi
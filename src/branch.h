@@ -0,0 +1,72 @@
+//========================================================//
+//  branch.h                                              //
+//  Branch record types shared by the trace readers and   //
+//  the predictors                                        //
+//========================================================//
+
+#ifndef BRANCH_H
+#define BRANCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// One dynamic branch, in the column order of the text trace:
+// Branch Address, Branch Target, (Taken-Not taken), (Conditional-Unconditional),
+// (Call-Not Call), (Ret-Not Ret), (Direct-NotDirect)
+typedef struct
+{
+  uint32_t pc;
+  uint32_t target;
+  uint32_t outcome;
+  uint32_t condition;
+  uint32_t call;
+  uint32_t ret;
+  uint32_t direct;
+} branch_t;
+
+// Flag bits of a packed branch
+#define BR_TAKEN 0x01
+#define BR_COND 0x02
+#define BR_CALL 0x04
+#define BR_RET 0x08
+#define BR_DIRECT 0x10
+
+// Number of records in a batch
+#define BATCH_SIZE 4096
+
+// A block of consecutive branches stored as struct-of-arrays, with
+// the outcome and type fields packed into BR_* bits
+typedef struct
+{
+  size_t count;
+  uint32_t pc[BATCH_SIZE];
+  uint32_t target[BATCH_SIZE];
+  uint8_t flags[BATCH_SIZE];
+} branch_batch_t;
+
+// Pack the type and outcome fields of a branch into BR_* bits.
+// Returns -1 if a field is neither 0 nor 1 and can't be packed.
+//
+static inline int pack_flags(const branch_t *br)
+{
+  if ((br->outcome | br->condition | br->call | br->ret | br->direct) > 1)
+    return -1;
+  return (br->outcome ? BR_TAKEN : 0) |
+         (br->condition ? BR_COND : 0) |
+         (br->call ? BR_CALL : 0) |
+         (br->ret ? BR_RET : 0) |
+         (br->direct ? BR_DIRECT : 0);
+}
+
+// Expand packed BR_* bits into the fields of a branch
+//
+static inline void unpack_flags(uint8_t flags, branch_t *br)
+{
+  br->outcome = flags & BR_TAKEN;
+  br->condition = (flags >> 1) & 1;
+  br->call = (flags >> 2) & 1;
+  br->ret = (flags >> 3) & 1;
+  br->direct = (flags >> 4) & 1;
+}
+
+#endif
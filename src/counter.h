@@ -0,0 +1,153 @@
+//========================================================//
+//  counter.h                                             //
+//  Saturating counter kernels and packed counter tables  //
+//                                                        //
+//  The kernels work on counters of any width without     //
+//  branching; tables pack 1, 2, 4 or 8-bit counters into //
+//  64-bit words so that large tables stay in the caches  //
+//========================================================//
+
+#ifndef COUNTER_H
+#define COUNTER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+//------------------------------------//
+//          Counter Kernels           //
+//------------------------------------//
+
+// An N-bit counter counts from 0 to ctr_max<N>() and predicts taken
+// in its upper half
+template <int N>
+inline uint32_t ctr_max()
+{
+  return (1u << N) - 1;
+}
+
+template <int N>
+inline uint32_t ctr_taken(uint32_t c)
+{
+  return c >> (N - 1);
+}
+
+template <int N>
+inline uint32_t ctr_inc(uint32_t c)
+{
+  return c + (c != ctr_max<N>());
+}
+
+template <int N>
+inline uint32_t ctr_dec(uint32_t c)
+{
+  return c - (c != 0);
+}
+
+// Move 'c' towards ctr_max<N>() if 'up' is 1, towards 0 if it is 0
+//
+template <int N>
+inline uint32_t ctr_update(uint32_t c, uint32_t up)
+{
+  return c + (up & (c != ctr_max<N>())) - ((up ^ 1) & (c != 0));
+}
+
+// The 2-bit transition as a table of next states, two bits for each
+// (up, counter) pair: up=0: 0 0 1 2, up=1: 1 2 3 3
+template <>
+inline uint32_t ctr_update<2>(uint32_t c, uint32_t up)
+{
+  return (0xF990u >> (2 * (c | up << 2))) & 3;
+}
+
+// An N-bit signed counter counts from -2^(N-1) to 2^(N-1)-1 and
+// predicts taken when it is not negative
+template <int N>
+inline int32_t sctr_update(int32_t c, uint32_t up)
+{
+  return c + (int32_t)(up & (c != (1 << (N - 1)) - 1)) - (int32_t)((up ^ 1) & (c != -(1 << (N - 1))));
+}
+
+//------------------------------------//
+//          Counter Tables            //
+//------------------------------------//
+
+// A table of 2^bits N-bit counters, 64/N to a word
+template <int N>
+class PackedCounters
+{
+public:
+  PackedCounters(int bits) : bits(bits)
+  {
+    words = (((size_t)1 << bits) + PER_WORD - 1) / PER_WORD;
+    table = (uint64_t *)malloc(words * sizeof(uint64_t));
+  }
+  ~PackedCounters() { free(table); }
+
+  // Set every counter to 'value'
+  void fill(uint32_t value)
+  {
+    uint64_t w = value * (~0ull / ctr_max<N>());
+    for (size_t i = 0; i < words; i++)
+    {
+      table[i] = w;
+    }
+  }
+
+  uint32_t get(uint32_t i) const
+  {
+    return (table[i / PER_WORD] >> (N * (i % PER_WORD))) & ctr_max<N>();
+  }
+
+  // TAKEN if counter 'i' is in its upper half
+  uint32_t taken(uint32_t i) const
+  {
+    return (table[i / PER_WORD] >> (N * (i % PER_WORD) + N - 1)) & 1;
+  }
+
+  // Move counter 'i' towards its maximum if 'up' is 1, towards 0 if it is 0
+  void update(uint32_t i, uint32_t up)
+  {
+    uint64_t *w = &table[i / PER_WORD];
+    int shift = N * (i % PER_WORD);
+    uint64_t c = (*w >> shift) & ctr_max<N>();
+    *w ^= (c ^ ctr_update<N>(c, up)) << shift;
+  }
+
+  // TAKEN if counter 'i' is in its upper half, then update it as
+  // update() does, touching its word once
+  uint32_t taken_update(uint32_t i, uint32_t up)
+  {
+    uint64_t *w = &table[i / PER_WORD];
+    int shift = N * (i % PER_WORD);
+    uint64_t c = (*w >> shift) & ctr_max<N>();
+    *w ^= (c ^ ctr_update<N>(c, up)) << shift;
+    return ctr_taken<N>(c);
+  }
+
+  // Bring the word of counter 'i' into the cache ahead of an update
+  void prefetch(uint32_t i) const
+  {
+    __builtin_prefetch(&table[i / PER_WORD], 1);
+  }
+
+  void increment(uint32_t i) { update(i, 1); }
+  void decrement(uint32_t i) { update(i, 0); }
+
+  // Number of counters
+  size_t size() const { return (size_t)1 << bits; }
+
+private:
+  static const int PER_WORD = 64 / N;
+  int bits;
+  size_t words;
+  uint64_t *table;
+
+  // The table is owned
+  PackedCounters(const PackedCounters &);
+  PackedCounters &operator=(const PackedCounters &);
+};
+
+// The 2-bit counters of the built-in predictors
+typedef PackedCounters<2> CounterTable;
+
+#endif
@@ -0,0 +1,232 @@
+//========================================================//
+//  counterbench.cpp                                      //
+//  Microbenchmark of the 2-bit counter kernels           //
+//                                                        //
+//  Predicts and trains a table of counters on a random   //
+//  stream of (index, outcome) pairs with each kernel and //
+//  reports branches per second                           //
+//========================================================//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "predictor.h"
+#include "counter.h"
+
+// Branches per stream
+#define STREAM_LEN (1 << 22)
+
+// Runs of each kernel; the fastest is reported
+#define RUNS 5
+
+typedef struct
+{
+  uint32_t *index;
+  uint8_t *outcome;
+  uint32_t mask;
+} stream_t;
+
+//------------------------------------//
+//              Kernels               //
+//------------------------------------//
+
+// The gshare kernel before the counter library: a switch over the
+// states for both prediction and training
+//
+static uint32_t run_switch(const stream_t *s)
+{
+  uint8_t *bht = (uint8_t *)malloc(s->mask + 1);
+  memset(bht, WN, s->mask + 1);
+  uint32_t mispredictions = 0;
+  for (size_t i = 0; i < STREAM_LEN; i++)
+  {
+    uint32_t index = s->index[i];
+    uint8_t outcome = s->outcome[i];
+    uint8_t prediction;
+    switch (bht[index])
+    {
+    case WN:
+    case SN:
+      prediction = NOTTAKEN;
+      break;
+    case WT:
+    case ST:
+      prediction = TAKEN;
+      break;
+    default:
+      printf("Warning: Undefined state of entry in GSHARE BHT!\n");
+      prediction = NOTTAKEN;
+    }
+    mispredictions += prediction != outcome;
+    switch (bht[index])
+    {
+    case WN:
+      bht[index] = (outcome == TAKEN) ? WT : SN;
+      break;
+    case SN:
+      bht[index] = (outcome == TAKEN) ? WN : SN;
+      break;
+    case WT:
+      bht[index] = (outcome == TAKEN) ? ST : WN;
+      break;
+    case ST:
+      bht[index] = (outcome == TAKEN) ? ST : WT;
+      break;
+    default:
+      printf("Warning: Undefined state of entry in GSHARE BHT!\n");
+      break;
+    }
+  }
+  free(bht);
+  return mispredictions;
+}
+
+// Byte counters with compare-and-branch saturation, as the tournament
+// and YAGS predictors had
+//
+static uint32_t run_branchy(const stream_t *s)
+{
+  uint8_t *bht = (uint8_t *)malloc(s->mask + 1);
+  memset(bht, WN, s->mask + 1);
+  uint32_t mispredictions = 0;
+  for (size_t i = 0; i < STREAM_LEN; i++)
+  {
+    uint8_t *c = &bht[s->index[i]];
+    uint8_t outcome = s->outcome[i];
+    mispredictions += ((*c == WT || *c == ST) ? TAKEN : NOTTAKEN) != outcome;
+    if (outcome == TAKEN)
+    {
+      if (*c < ST) (*c)++;
+    }
+    else
+    {
+      if (*c > SN) (*c)--;
+    }
+  }
+  free(bht);
+  return mispredictions;
+}
+
+// Byte counters with the branch-free kernels
+//
+static uint32_t run_byte(const stream_t *s)
+{
+  uint8_t *bht = (uint8_t *)malloc(s->mask + 1);
+  memset(bht, WN, s->mask + 1);
+  uint32_t mispredictions = 0;
+  for (size_t i = 0; i < STREAM_LEN; i++)
+  {
+    uint8_t *c = &bht[s->index[i]];
+    uint8_t outcome = s->outcome[i];
+    mispredictions += ctr_taken<2>(*c) != outcome;
+    *c = ctr_update<2>(*c, outcome);
+  }
+  free(bht);
+  return mispredictions;
+}
+
+// Packed counters, as the predictors use them
+//
+static uint32_t run_packed(const stream_t *s)
+{
+  int bits = __builtin_popcount(s->mask);
+  CounterTable bht(bits);
+  bht.fill(WN);
+  uint32_t mispredictions = 0;
+  for (size_t i = 0; i < STREAM_LEN; i++)
+  {
+    uint32_t index = s->index[i];
+    uint8_t outcome = s->outcome[i];
+    mispredictions += bht.taken(index) != outcome;
+    bht.update(index, outcome);
+  }
+  return mispredictions;
+}
+
+//------------------------------------//
+//              Driver                //
+//------------------------------------//
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Fill 's' with indices into a table of 2^bits entries and outcomes
+// that are taken with probability 'bias' at each entry
+//
+static void make_stream(stream_t *s, int bits, double bias)
+{
+  s->mask = (1u << bits) - 1;
+  uint64_t x = 0x9E3779B97F4A7C15ull;
+  for (size_t i = 0; i < STREAM_LEN; i++)
+  {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    s->index[i] = (uint32_t)x & s->mask;
+    s->outcome[i] = (double)(x >> 11) * (1.0 / 9007199254740992.0) < bias;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  static const int sizes[] = {10, 17, 22};
+  static const double biases[] = {0.5, 0.9, 0.99};
+  static const char *names[] = {"switch", "branchy", "byte", "packed"};
+  uint32_t (*kernels[])(const stream_t *) = {run_switch, run_branchy, run_byte, run_packed};
+  const int numKernels = 4;
+
+  stream_t s;
+  s.index = (uint32_t *)malloc(STREAM_LEN * sizeof(uint32_t));
+  s.outcome = (uint8_t *)malloc(STREAM_LEN);
+
+  printf("Million branches per second, %d branches per stream\n", STREAM_LEN);
+  printf("Entries  Taken");
+  for (int k = 0; k < numKernels; k++)
+    printf("  %8s", names[k]);
+  printf("\n");
+
+  int ok = 1;
+  for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++)
+  {
+    for (size_t b = 0; b < sizeof(biases) / sizeof(biases[0]); b++)
+    {
+      make_stream(&s, sizes[z], biases[b]);
+      double best[4] = {1e9, 1e9, 1e9, 1e9};
+      uint32_t result[4];
+
+      // Interleave the kernels so that noise hits them alike
+      for (int r = 0; r < RUNS; r++)
+      {
+        for (int k = 0; k < numKernels; k++)
+        {
+          double t = now();
+          result[k] = kernels[k](&s);
+          t = now() - t;
+          if (t < best[k])
+            best[k] = t;
+        }
+      }
+
+      printf("2^%-5d %5.0f%%", sizes[z], biases[b] * 100);
+      for (int k = 0; k < numKernels; k++)
+      {
+        printf("  %8.1f", STREAM_LEN / best[k] / 1e6);
+        ok &= result[k] == result[0];
+      }
+      printf("\n");
+    }
+  }
+
+  free(s.index);
+  free(s.outcome);
+  if (!ok)
+  {
+    printf("Kernels disagree on the number of mispredictions\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,130 @@
+//========================================================//
+//  folded.h                                              //
+//  Long histories and their folded registers             //
+//                                                        //
+//  A predictor keeps up to 2^11 bits of global or path   //
+//  history in a ring and subscribes registers holding    //
+//  the XOR fold of its newest bits. Each bit pushed      //
+//  costs O(1) per register whatever its length, eight    //
+//  registers to an SSE2 vector.                          //
+//========================================================//
+
+#ifndef FOLDED_H
+#define FOLDED_H
+
+#include <stdint.h>
+#include <string.h>
+#include <emmintrin.h>
+
+// Bits of history kept, a power of 2 above the longest length
+#define LONG_HISTORY 2048
+
+// Most folded registers on one history, a multiple of 8
+#define LONG_HISTORY_FOLDS 32
+
+// A history of bits, outcomes for a global history or address bits
+// for a path history, and the registers folded from it. Register r is
+// value[r]: bit i back in the history (0 the newest) is XORed into its
+// bit i % width, for i < length.
+typedef struct
+{
+  uint16_t value[LONG_HISTORY_FOLDS];
+  uint16_t top[LONG_HISTORY_FOLDS];  // bit width - 1, which wraps to bit 0
+  uint16_t mask[LONG_HISTORY_FOLDS]; // bits of the register
+  uint16_t out[LONG_HISTORY_FOLDS];  // where the bit leaving the window is
+  uint16_t length[LONG_HISTORY_FOLDS];
+  uint8_t repeat[LONG_HISTORY_FOLDS / 8]; // vector of registers with the
+                                         // lengths of the one before
+  int folds;
+  uint32_t head;
+  int16_t bits[2 * LONG_HISTORY]; // bit i back at head + i, 0 or -1, kept twice
+                                  // so that the window never wraps
+} long_history_t;
+
+// Clear the history and its registers, keeping the registers subscribed
+//
+inline void long_history_clear(long_history_t *h)
+{
+  memset(h->value, 0, sizeof(h->value));
+  memset(h->bits, 0, sizeof(h->bits));
+  h->head = 0;
+}
+
+// An empty history with no registers
+//
+inline void long_history_init(long_history_t *h)
+{
+  memset(h, 0, sizeof(*h));
+}
+
+// Subscribe a register folding the newest 'length' bits (1 to
+// LONG_HISTORY - 1) to 'width' bits (1 to 16), starting from the
+// current history. Registers subscribed one after another are adjacent
+// in value[], so a predictor can load those of all its tables at once.
+//
+// Returns the register, -1 if there are too many or the sizes are out
+// of range
+//
+inline int long_history_fold(long_history_t *h, int length, int width)
+{
+  if (h->folds == LONG_HISTORY_FOLDS || length < 1 || length >= LONG_HISTORY || width < 1 || width > 16)
+    return -1;
+  int r = h->folds++;
+  h->top[r] = 1 << (width - 1);
+  h->mask[r] = (1u << width) - 1;
+  h->out[r] = 1 << (length % width);
+  h->length[r] = length;
+  h->value[r] = 0;
+  for (int v = 1; v < LONG_HISTORY_FOLDS / 8; v++)
+  {
+    h->repeat[v] = !memcmp(&h->length[8 * v], &h->length[8 * v - 8], 8 * sizeof(uint16_t));
+  }
+  for (int i = length - 1; i >= 0; i--)
+  {
+    h->value[r] ^= (h->bits[(h->head + i) % LONG_HISTORY] & 1) << (i % width);
+  }
+  return r;
+}
+
+// Bit 'age' back in the history, 0 the newest
+//
+inline uint32_t long_history_bit(const long_history_t *h, int age)
+{
+  return h->bits[(h->head + age) % LONG_HISTORY] & 1;
+}
+
+// Shift 'bit' (0 or 1) into the history. Each register rotates left by
+// one within its width, takes the new bit in at bit 0 and drops the bit
+// leaving its window.
+//
+inline void long_history_push(long_history_t *h, uint32_t bit)
+{
+  h->head = (h->head - 1) % LONG_HISTORY;
+  h->bits[h->head] = -(int16_t)bit;
+  h->bits[h->head + LONG_HISTORY] = -(int16_t)bit;
+
+  // The bits leaving the windows, read without wrapping around
+  const int16_t *b = &h->bits[h->head];
+  const __m128i in = _mm_set1_epi16((int16_t)bit);
+  __m128i leaving = _mm_setzero_si128();
+  for (int r = 0; r < h->folds; r += 8)
+  {
+    // Registers of the same lengths at different widths, as for the
+    // index and tag of a tagged table, share the bits read
+    if (!h->repeat[r / 8])
+    {
+      const uint16_t *l = &h->length[r];
+      leaving = _mm_setr_epi16(b[l[0]], b[l[1]], b[l[2]], b[l[3]], b[l[4]], b[l[5]], b[l[6]], b[l[7]]);
+    }
+    __m128i v = _mm_loadu_si128((const __m128i *)&h->value[r]);
+    __m128i top = _mm_loadu_si128((const __m128i *)&h->top[r]);
+    // The top bit wraps around to bit 0
+    __m128i wrap = _mm_srli_epi16(_mm_cmpeq_epi16(_mm_and_si128(v, top), top), 15);
+    v = _mm_or_si128(_mm_slli_epi16(v, 1), in);
+    v = _mm_xor_si128(v, _mm_and_si128(leaving, _mm_loadu_si128((const __m128i *)&h->out[r])));
+    v = _mm_and_si128(_mm_xor_si128(v, wrap), _mm_loadu_si128((const __m128i *)&h->mask[r]));
+    _mm_storeu_si128((__m128i *)&h->value[r], v);
+  }
+}
+
+#endif
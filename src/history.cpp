@@ -0,0 +1,199 @@
+//========================================================//
+//  history.cpp                                           //
+//  Global history and table index streams                //
+//                                                        //
+//  With AVX2 the histories of 64 branches are funnel     //
+//  shifts of the history before them and a word of their //
+//  outcomes, four to a vector.                           //
+//========================================================//
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "history.h"
+
+typedef void (*gather_fn)(const branch_batch_t *b, history_stream_t *s);
+typedef void (*history_fn)(history_stream_t *s, uint64_t history);
+typedef void (*index_fn)(const history_stream_t *s, uint32_t mask, uint32_t *index);
+
+//------------------------------------//
+//              Scalar                //
+//------------------------------------//
+
+static void gather_scalar(const branch_batch_t *b, history_stream_t *s)
+{
+  // The byte stores may alias anything, so everything read is in locals
+  const uint32_t *pc = b->pc;
+  const uint8_t *flags = b->flags;
+  uint16_t *slot = s->slot;
+  uint32_t *cpc = s->pc;
+  uint8_t *outcome = s->outcome;
+  size_t count = b->count;
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    uint8_t f = flags[i];
+    slot[n] = i;
+    cpc[n] = pc[i];
+    outcome[n] = f & BR_TAKEN;
+    n += (f & BR_COND) != 0;
+  }
+  s->count = n;
+}
+
+static void histories_scalar(history_stream_t *s, uint64_t history)
+{
+  for (size_t k = 0; k < s->count; k++)
+  {
+    s->history[k] = history;
+    history = (history << 1) | s->outcome[k];
+  }
+  s->final_history = history;
+}
+
+static void index_scalar(const history_stream_t *s, uint32_t mask, uint32_t *index)
+{
+  for (size_t k = 0; k < s->count; k++)
+  {
+    index[k] = (s->pc[k] ^ (uint32_t)s->history[k]) & mask;
+  }
+}
+
+//------------------------------------//
+//          AVX-512 and AVX2          //
+//------------------------------------//
+
+// Compress 16 records at a time into the stream. The stores run up to
+// 15 entries past the conditional branches written, never past the
+// records read.
+__attribute__((target("avx512f"))) static void gather_avx512(const branch_batch_t *b, history_stream_t *s)
+{
+  const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  size_t count = b->count;
+  size_t n = 0;
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16)
+  {
+    __m512i f = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)&b->flags[i]));
+    __mmask16 cond = _mm512_test_epi32_mask(f, _mm512_set1_epi32(BR_COND));
+    __m512i slot = _mm512_add_epi32(lanes, _mm512_set1_epi32(i));
+    __m512i outcome = _mm512_and_si512(f, _mm512_set1_epi32(BR_TAKEN));
+    __m512i pc = _mm512_loadu_si512(&b->pc[i]);
+    _mm256_storeu_si256((__m256i *)&s->slot[n], _mm512_cvtepi32_epi16(_mm512_maskz_compress_epi32(cond, slot)));
+    _mm512_storeu_si512(&s->pc[n], _mm512_maskz_compress_epi32(cond, pc));
+    _mm_storeu_si128((__m128i *)&s->outcome[n], _mm512_cvtepi32_epi8(_mm512_maskz_compress_epi32(cond, outcome)));
+    n += __builtin_popcount(cond);
+  }
+  for (; i < count; i++)
+  {
+    uint8_t f = b->flags[i];
+    s->slot[n] = i;
+    s->pc[n] = b->pc[i];
+    s->outcome[n] = f & BR_TAKEN;
+    n += (f & BR_COND) != 0;
+  }
+  s->count = n;
+}
+
+// The outcomes of 32 branches from 'p', the first in bit 31
+__attribute__((target("avx2"))) static inline uint32_t outcomes_reversed(const uint8_t *p)
+{
+  const __m256i reverse = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                           15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  __m256i v = _mm256_loadu_si256((const __m256i *)p);
+  v = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, reverse), 0x4E);
+  return (uint32_t)_mm256_movemask_epi8(_mm256_slli_epi16(v, 7));
+}
+
+__attribute__((target("avx2"))) static void histories_avx2(history_stream_t *s, uint64_t history)
+{
+  const __m256i four = _mm256_set1_epi64x(4);
+  const __m256i sixty_four = _mm256_set1_epi64x(64);
+  size_t n = s->count;
+  for (size_t k = 0; k < n; k += 64)
+  {
+    // The history 64 branches on: the first outcome in bit 63
+    uint64_t word = (uint64_t)outcomes_reversed(&s->outcome[k]) << 32 |
+                    outcomes_reversed(&s->outcome[k + 32]);
+
+    // history << j | word >> (64 - j), the shift by 64 giving 0
+    __m256i h = _mm256_set1_epi64x(history);
+    __m256i w = _mm256_set1_epi64x(word);
+    __m256i j = _mm256_setr_epi64x(0, 1, 2, 3);
+    size_t m = n - k < 64 ? n - k : 64;
+    for (size_t i = 0; i < m; i += 4)
+    {
+      __m256i v = _mm256_or_si256(_mm256_sllv_epi64(h, j),
+                                  _mm256_srlv_epi64(w, _mm256_sub_epi64(sixty_four, j)));
+      _mm256_storeu_si256((__m256i *)&s->history[k + i], v);
+      j = _mm256_add_epi64(j, four);
+    }
+    history = m == 64 ? word : (history << m) | (word >> (64 - m));
+  }
+  s->final_history = history;
+}
+
+__attribute__((target("avx2"))) static void index_avx2(const history_stream_t *s, uint32_t mask,
+                                                       uint32_t *index)
+{
+  const __m256i low = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  const __m256i m = _mm256_set1_epi32(mask);
+  size_t n = s->count;
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8)
+  {
+    // The low halves of eight histories
+    __m256i h0 = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)&s->history[k]), low);
+    __m256i h1 = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)&s->history[k + 4]), low);
+    __m256i h = _mm256_permute2x128_si256(h0, h1, 0x20);
+    __m256i pc = _mm256_loadu_si256((const __m256i *)&s->pc[k]);
+    _mm256_storeu_si256((__m256i *)&index[k], _mm256_and_si256(_mm256_xor_si256(pc, h), m));
+  }
+  for (; k < n; k++)
+  {
+    index[k] = (s->pc[k] ^ (uint32_t)s->history[k]) & mask;
+  }
+}
+
+//------------------------------------//
+//             Interface              //
+//------------------------------------//
+
+// The kernels for this CPU. BP_HISTORY_SIMD=avx2 or =scalar caps the
+// instruction set used.
+static struct history_kernels
+{
+  gather_fn gather;
+  history_fn histories;
+  index_fn index;
+
+  history_kernels()
+  {
+    const char *cap = getenv("BP_HISTORY_SIMD");
+    int allow512 = !cap || !strcmp(cap, "avx512");
+    int allow256 = allow512 || !strcmp(cap, "avx2");
+
+    __builtin_cpu_init();
+    gather = gather_scalar;
+    histories = histories_scalar;
+    index = index_scalar;
+    if (allow512 && __builtin_cpu_supports("avx512f"))
+      gather = gather_avx512;
+    if (allow256 && __builtin_cpu_supports("avx2"))
+    {
+      histories = histories_avx2;
+      index = index_avx2;
+    }
+  }
+} kernels;
+
+void history_stream_build(const branch_batch_t *b, uint64_t history, history_stream_t *s)
+{
+  s->batch = b;
+  kernels.gather(b, s);
+  kernels.histories(s, history);
+}
+
+void history_stream_index(const history_stream_t *s, uint32_t mask, uint32_t *index)
+{
+  kernels.index(s, mask, index);
+}
@@ -0,0 +1,44 @@
+//========================================================//
+//  history.h                                             //
+//  Global history and table index streams                //
+//                                                        //
+//  The global history before each conditional branch     //
+//  depends only on the outcomes in the trace, so it is   //
+//  computed for a whole batch ahead of the predictor     //
+//========================================================//
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include "branch.h"
+
+// The conditional branches of a batch, in trace order
+typedef struct
+{
+  const branch_batch_t *batch;      // every branch, for predictors that
+                                    // track more than these
+  size_t count;
+  uint16_t slot[BATCH_SIZE];        // position in the batch
+  uint32_t pc[BATCH_SIZE];
+  uint8_t outcome[BATCH_SIZE + 64]; // padded for whole-word reads
+  uint64_t history[BATCH_SIZE + 4]; // global history before the branch,
+                                    // newest outcome in bit 0; padded
+                                    // for whole-vector writes
+  uint64_t final_history;           // global history after the batch
+} history_stream_t;
+
+// Fill 's' with the conditional branches of 'b', given global history
+// 'history' before the first; 'b' must outlive 's'. Uses AVX-512 and
+// AVX2 where the CPU supports them; BP_HISTORY_SIMD=avx2 or
+// BP_HISTORY_SIMD=scalar in the environment caps the instruction set
+// used.
+//
+void history_stream_build(const branch_batch_t *b, uint64_t history, history_stream_t *s);
+
+// Fill index[k] with (pc ^ history) & mask for branch k of 's', the
+// gshare index
+//
+void history_stream_index(const history_stream_t *s, uint32_t mask, uint32_t *index);
+
+#endif
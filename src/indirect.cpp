@@ -0,0 +1,239 @@
+//========================================================//
+//  indirect.cpp                                          //
+//  Indirect target predictor                             //
+//                                                        //
+//  ITTAGE over a long history of conditional outcomes    //
+//  and indirect targets, kept folded for every bank      //
+//========================================================//
+#include <stdlib.h>
+#include <string.h>
+#include "indirect.h"
+#include "counter.h"
+
+// History lengths from 4 to 360, about 1.8 times longer each bank, and
+// longer tags for the longer histories
+const int IttagePredictor::LENGTH[ITTAGE_BANKS] = {4, 8, 15, 28, 50, 90, 200, 360};
+const int IttagePredictor::TAG_BITS[ITTAGE_BANKS] = {9, 9, 10, 10, 11, 11, 12, 12};
+
+static uint32_t entry(int b, uint32_t i)
+{
+  return ((uint32_t)b << ITTAGE_BANK_BITS) | i;
+}
+
+static uint32_t base_index(uint32_t pc)
+{
+  return (pc ^ (pc >> ITTAGE_BASE_BITS)) & ((1 << ITTAGE_BASE_BITS) - 1);
+}
+
+IttagePredictor::IttagePredictor()
+{
+  base = (uint32_t *)malloc(sizeof(uint32_t) << ITTAGE_BASE_BITS);
+  banks = (entry_t *)malloc((sizeof(entry_t) * ITTAGE_BANKS) << ITTAGE_BANK_BITS);
+  // The index registers of the banks, then the two tag registers
+  long_history_init(&hist);
+  for (int b = 0; b < ITTAGE_BANKS; b++)
+  {
+    long_history_fold(&hist, LENGTH[b], ITTAGE_BANK_BITS);
+  }
+  for (int b = 0; b < ITTAGE_BANKS; b++)
+  {
+    long_history_fold(&hist, LENGTH[b], TAG_BITS[b]);
+  }
+  for (int b = 0; b < ITTAGE_BANKS; b++)
+  {
+    long_history_fold(&hist, LENGTH[b], TAG_BITS[b] - 1);
+  }
+  reset();
+}
+
+IttagePredictor::~IttagePredictor()
+{
+  free(base);
+  free(banks);
+}
+
+void IttagePredictor::reset()
+{
+  memset(base, 0, sizeof(uint32_t) << ITTAGE_BASE_BITS);
+  memset(banks, 0, (sizeof(entry_t) * ITTAGE_BANKS) << ITTAGE_BANK_BITS);
+  long_history_clear(&hist);
+  tick = 0;
+  seed = 1;
+}
+
+uint32_t IttagePredictor::predict(uint32_t pc) const
+{
+  lookup_t l;
+  lookup(pc, &l);
+  return l.prediction;
+}
+
+void IttagePredictor::update(uint32_t pc, uint32_t target)
+{
+  lookup_t l;
+  lookup(pc, &l);
+  train(pc, &l, target);
+}
+
+void IttagePredictor::track(uint32_t pc, uint32_t target, uint8_t flags)
+{
+  if (flags & BR_COND)
+  {
+    long_history_push(&hist, flags & BR_TAKEN);
+  }
+  else if (is_indirect(flags))
+  {
+    // Two bits of the target tell the targets of a branch apart
+    uint32_t t = target ^ (target >> 3);
+    long_history_push(&hist, t & 1);
+    long_history_push(&hist, (t >> 1) & 1);
+  }
+}
+
+uint32_t IttagePredictor::run(const branch_batch_t *b, uint64_t *count)
+{
+  uint32_t mispredictions = 0;
+  for (size_t i = 0; i < b->count; i++)
+  {
+    uint8_t flags = b->flags[i];
+    if (is_indirect(flags))
+    {
+      lookup_t l;
+      lookup(b->pc[i], &l);
+      mispredictions += l.prediction != b->target[i];
+      train(b->pc[i], &l, b->target[i]);
+      (*count)++;
+    }
+    track(b->pc[i], b->target[i], flags);
+  }
+  return mispredictions;
+}
+
+uint64_t IttagePredictor::storage_bits() const
+{
+  uint64_t bits = (uint64_t)32 << ITTAGE_BASE_BITS;
+  for (int b = 0; b < ITTAGE_BANKS; b++)
+  {
+    // Target, tag, 2-bit confidence and useful bit per entry, and the
+    // three folded registers of the bank
+    bits += (uint64_t)(32 + TAG_BITS[b] + 2 + 1) << ITTAGE_BANK_BITS;
+    bits += ITTAGE_BANK_BITS + TAG_BITS[b] + TAG_BITS[b] - 1;
+  }
+  // History and age counter
+  return bits + LENGTH[ITTAGE_BANKS - 1] + ITTAGE_AGE_BITS;
+}
+
+// Index and tag of every bank, then the provider and alternate. An
+// entry whose target has just been replaced is not trusted over the
+// alternate.
+void IttagePredictor::lookup(uint32_t pc, lookup_t *l) const
+{
+  l->provider = -1;
+  l->alt = -1;
+  for (int b = ITTAGE_BANKS - 1; b >= 0; b--)
+  {
+    uint32_t tagMask = (1 << TAG_BITS[b]) - 1;
+    l->index[b] = (pc ^ (pc >> ITTAGE_BANK_BITS) ^ hist.value[b]) & ((1 << ITTAGE_BANK_BITS) - 1);
+    l->tag[b] = (pc >> 2 ^ pc >> 17 ^ hist.value[ITTAGE_BANKS + b] ^ hist.value[2 * ITTAGE_BANKS + b] << 1) &
+                tagMask;
+    if (l->alt < 0 && banks[entry(b, l->index[b])].tag == l->tag[b])
+    {
+      if (l->provider >= 0)
+        l->alt = b;
+      else
+        l->provider = b;
+    }
+  }
+
+  uint32_t baseTarget = base[base_index(pc)];
+  l->altTarget = l->alt < 0 ? baseTarget : banks[entry(l->alt, l->index[l->alt])].target;
+  if (l->provider < 0)
+  {
+    l->providerTarget = l->prediction = baseTarget;
+    return;
+  }
+  const entry_t *e = &banks[entry(l->provider, l->index[l->provider])];
+  l->providerTarget = e->target;
+  l->prediction = e->ctr == 0 ? l->altTarget : l->providerTarget;
+}
+
+void IttagePredictor::train(uint32_t pc, const lookup_t *l, uint32_t target)
+{
+  int p = l->provider;
+
+  // On a misprediction take an entry in a longer bank
+  if (l->prediction != target && p < ITTAGE_BANKS - 1)
+  {
+    allocate(l, target);
+  }
+
+  if (p >= 0)
+  {
+    entry_t *e = &banks[entry(p, l->index[p])];
+    // The alternate learns too while the provider is unconfident
+    if (e->ctr == 0)
+    {
+      if (l->alt >= 0)
+      {
+        entry_t *a = &banks[entry(l->alt, l->index[l->alt])];
+        if (a->target != target && a->ctr == 0)
+          a->target = target;
+        else
+          a->ctr = ctr_update<2>(a->ctr, a->target == target);
+      }
+      else
+      {
+        base[base_index(pc)] = target;
+      }
+    }
+    if (l->providerTarget != l->altTarget)
+    {
+      e->useful = l->providerTarget == target;
+    }
+    // A confident entry loses confidence before its target is replaced
+    if (e->target != target && e->ctr == 0)
+      e->target = target;
+    else
+      e->ctr = ctr_update<2>(e->ctr, e->target == target);
+  }
+  else
+  {
+    base[base_index(pc)] = target;
+  }
+
+  if ((++tick & ((1 << ITTAGE_AGE_BITS) - 1)) == 0)
+  {
+    for (size_t i = 0; i < (size_t)ITTAGE_BANKS << ITTAGE_BANK_BITS; i++)
+    {
+      banks[i].useful = 0;
+    }
+  }
+}
+
+// Claim the first entry not marked useful in a bank longer than the
+// provider, sometimes skipping one so that allocations spread out, or
+// clear the useful bits of all of them if none is free
+void IttagePredictor::allocate(const lookup_t *l, uint32_t target)
+{
+  int first = l->provider + 1;
+  seed = seed * 1103515245 + 12345;
+  if (first < ITTAGE_BANKS - 1 && (seed >> 16) & 1)
+  {
+    first++;
+  }
+  for (int b = first; b < ITTAGE_BANKS; b++)
+  {
+    entry_t *e = &banks[entry(b, l->index[b])];
+    if (e->useful == 0)
+    {
+      e->target = target;
+      e->tag = l->tag[b];
+      e->ctr = 0;
+      return;
+    }
+  }
+  for (int b = l->provider + 1; b < ITTAGE_BANKS; b++)
+  {
+    banks[entry(b, l->index[b])].useful = 0;
+  }
+}
@@ -0,0 +1,106 @@
+//========================================================//
+//  indirect.h                                            //
+//  Header file for the indirect target predictor         //
+//                                                        //
+//  Predicts the targets of indirect jumps and calls      //
+//  with an ITTAGE, alongside the direction predictors    //
+//========================================================//
+
+#ifndef INDIRECT_H
+#define INDIRECT_H
+
+#include <stdint.h>
+#include "branch.h"
+#include "folded.h"
+
+#define ITTAGE_BANKS 8
+#define ITTAGE_BANK_BITS 9  // log2 of the entries of a tagged bank
+#define ITTAGE_BASE_BITS 10 // log2 of the last targets indexed by PC alone
+#define ITTAGE_AGE_BITS 18  // useful bits are cleared every 2^18 indirect branches
+
+// The branches whose targets are predicted: indirect jumps and calls.
+// Returns go to the return address, and direct branches to the target
+// encoded in them.
+//
+static inline int is_indirect(uint8_t flags)
+{
+  return !(flags & (BR_DIRECT | BR_RET | BR_COND));
+}
+
+// ITTAGE (Seznec): a table of last targets indexed by PC and tagged
+// banks of targets indexed with geometrically longer histories of
+// conditional outcomes and indirect targets. The longest history whose
+// tag matches provides the target.
+class IttagePredictor
+{
+public:
+  IttagePredictor();
+  ~IttagePredictor();
+
+  void reset();
+
+  // Predicted target of the indirect branch at 'pc'
+  //
+  uint32_t predict(uint32_t pc) const;
+
+  // Train on the target of the indirect branch at 'pc'. Other branches
+  // only go through track().
+  //
+  void update(uint32_t pc, uint32_t target);
+
+  // See a branch of any kind, with its BR_* bits in 'flags', after
+  // update() if it is indirect
+  //
+  void track(uint32_t pc, uint32_t target, uint8_t flags);
+
+  // Predict and train on the indirect branches of 'b' and track every
+  // branch, in trace order. Adds the number of indirect branches to
+  // '*count'.
+  //
+  // Returns the number of mispredicted targets
+  //
+  uint32_t run(const branch_batch_t *b, uint64_t *count);
+
+  uint64_t storage_bits() const;
+
+private:
+  static const int LENGTH[ITTAGE_BANKS];
+  static const int TAG_BITS[ITTAGE_BANKS];
+
+  // A tagged entry: 2-bit confidence in the target and 1 useful bit
+  typedef struct
+  {
+    uint32_t target;
+    uint16_t tag;
+    uint8_t ctr;
+    uint8_t useful;
+  } entry_t;
+
+  // What every bank holds for one branch
+  typedef struct
+  {
+    uint16_t index[ITTAGE_BANKS];
+    uint16_t tag[ITTAGE_BANKS];
+    int provider; // longest matching bank, -1 for none
+    int alt;      // next longest, -1 for none
+    uint32_t providerTarget;
+    uint32_t altTarget;
+    uint32_t prediction;
+  } lookup_t;
+
+  uint32_t *base;
+  entry_t *banks; // bank b, entry i at (b << ITTAGE_BANK_BITS) | i
+  long_history_t hist; // outcomes and target bits, and the folds of each bank
+  uint32_t tick;
+  uint32_t seed;
+
+  void lookup(uint32_t pc, lookup_t *l) const;
+  void train(uint32_t pc, const lookup_t *l, uint32_t target);
+  void allocate(const lookup_t *l, uint32_t target);
+
+  // The tables are owned
+  IttagePredictor(const IttagePredictor &);
+  IttagePredictor &operator=(const IttagePredictor &);
+};
+
+#endif
@@ -0,0 +1,134 @@
+//========================================================//
+//  lanes.cpp                                             //
+//  Lane-parallel gshare                                  //
+//                                                        //
+//  Each lane has its own table of 2-bit counters, 16 to  //
+//  a 32-bit word, in one arena. With AVX-512 a branch    //
+//  gathers the word of every lane, updates the counters  //
+//  and scatters back the words that changed.             //
+//========================================================//
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "lanes.h"
+#include "history.h"
+
+// Counters of every lane, WN (01) in each 2-bit field
+typedef struct
+{
+  uint32_t *words;
+  uint32_t offset[GSHARE_LANES]; // first word of each lane
+  uint32_t mask[GSHARE_LANES];   // of each lane's index
+} lane_tables_t;
+
+typedef void (*lanes_fn)(const lane_tables_t *t, int n, const history_stream_t *s, uint32_t *miss);
+
+//------------------------------------//
+//              Scalar                //
+//------------------------------------//
+
+static void lanes_scalar(const lane_tables_t *t, int n, const history_stream_t *s, uint32_t *miss)
+{
+  for (size_t k = 0; k < s->count; k++)
+  {
+    uint32_t x = s->pc[k] ^ (uint32_t)s->history[k];
+    uint32_t outcome = s->outcome[k];
+    for (int l = 0; l < n; l++)
+    {
+      uint32_t i = x & t->mask[l];
+      uint32_t *w = &t->words[t->offset[l] + i / 16];
+      int shift = 2 * (i % 16);
+      uint32_t c = (*w >> shift) & 3;
+      miss[l] += (c >> 1) != outcome;
+      *w ^= (c ^ ((0xF990u >> (2 * (c | outcome << 2))) & 3)) << shift;
+    }
+  }
+}
+
+//------------------------------------//
+//              AVX-512               //
+//------------------------------------//
+
+__attribute__((target("avx512f"))) static void lanes_avx512(const lane_tables_t *t, int n,
+                                                            const history_stream_t *s, uint32_t *miss)
+{
+  const __m512i three = _mm512_set1_epi32(3);
+  const __m512i one = _mm512_set1_epi32(1);
+  const __m512i next = _mm512_set1_epi32(0xF990);
+  __mmask16 live = (__mmask16)((1u << n) - 1);
+  __m512i offset = _mm512_maskz_loadu_epi32(live, t->offset);
+  __m512i mask = _mm512_maskz_loadu_epi32(live, t->mask);
+  __m512i misses = _mm512_maskz_loadu_epi32(live, miss);
+
+  for (size_t k = 0; k < s->count; k++)
+  {
+    __m512i i = _mm512_and_si512(_mm512_set1_epi32(s->pc[k] ^ (uint32_t)s->history[k]), mask);
+    __m512i outcome = _mm512_set1_epi32(s->outcome[k]);
+    __m512i word = _mm512_add_epi32(offset, _mm512_srli_epi32(i, 4));
+    __m512i shift = _mm512_slli_epi32(_mm512_and_si512(i, _mm512_set1_epi32(15)), 1);
+    __m512i w = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), live, word, t->words, 4);
+
+    __m512i c = _mm512_and_si512(_mm512_srlv_epi32(w, shift), three);
+    __mmask16 wrong = _mm512_cmpneq_epi32_mask(_mm512_srli_epi32(c, 1), outcome);
+    misses = _mm512_mask_add_epi32(misses, wrong, misses, one);
+
+    // Only the words of counters that moved are written back
+    __m512i state = _mm512_slli_epi32(_mm512_or_si512(c, _mm512_slli_epi32(outcome, 2)), 1);
+    __m512i moved = _mm512_xor_si512(c, _mm512_and_si512(_mm512_srlv_epi32(next, state), three));
+    __mmask16 changed = _mm512_mask_test_epi32_mask(live, moved, moved);
+    w = _mm512_xor_si512(w, _mm512_sllv_epi32(moved, shift));
+    _mm512_mask_i32scatter_epi32(t->words, changed, word, w, 4);
+  }
+  _mm512_mask_storeu_epi32(miss, live, misses);
+}
+
+//------------------------------------//
+//             Interface              //
+//------------------------------------//
+
+static lanes_fn lanes_kernel()
+{
+  const char *cap = getenv("BP_LANES_SIMD");
+  __builtin_cpu_init();
+  if ((!cap || strcmp(cap, "scalar")) && __builtin_cpu_supports("avx512f"))
+    return lanes_avx512;
+  return lanes_scalar;
+}
+
+void gshare_lanes_run(const std::vector<branch_batch_t *> &batches, const int *bits, int n,
+                      uint64_t *mispredictions)
+{
+  static const lanes_fn run = lanes_kernel();
+
+  lane_tables_t t;
+  size_t words = 0;
+  for (int l = 0; l < n; l++)
+  {
+    t.offset[l] = words;
+    t.mask[l] = (1u << bits[l]) - 1;
+    words += ((1u << bits[l]) + 15) / 16;
+  }
+  t.words = (uint32_t *)malloc(words * sizeof(uint32_t));
+  for (size_t i = 0; i < words; i++)
+  {
+    t.words[i] = 0x55555555;
+  }
+
+  // Every lane sees the same global histories, as gshare predictors
+  // started together do
+  history_stream_t *s = (history_stream_t *)malloc(sizeof(history_stream_t));
+  uint64_t history = 0;
+  for (size_t b = 0; b < batches.size(); b++)
+  {
+    uint32_t miss[GSHARE_LANES] = {0};
+    history_stream_build(batches[b], history, s);
+    history = s->final_history;
+    run(&t, n, s, miss);
+    for (int l = 0; l < n; l++)
+    {
+      mispredictions[l] += miss[l];
+    }
+  }
+  free(s);
+  free(t.words);
+}
@@ -0,0 +1,29 @@
+//========================================================//
+//  lanes.h                                               //
+//  Header file for lane-parallel gshare                  //
+//                                                        //
+//  Runs several gshare configurations side by side over  //
+//  one pass of a decoded trace                           //
+//========================================================//
+
+#ifndef LANES_H
+#define LANES_H
+
+#include <stdint.h>
+#include <vector>
+#include "branch.h"
+
+// Most gshare configurations run in one pass
+#define GSHARE_LANES 16
+
+// Run gshare with bits[l] bits of global history, for each of the 'n'
+// (at most GSHARE_LANES) lanes, over 'batches' in order, and add the
+// mispredictions of lane l to mispredictions[l]. Each lane counts what
+// a separate gshare predictor would. Uses AVX-512 gathers and scatters
+// where the CPU supports them unless BP_LANES_SIMD=scalar is set in the
+// environment.
+//
+void gshare_lanes_run(const std::vector<branch_batch_t *> &batches, const int *bits, int n,
+                      uint64_t *mispredictions);
+
+#endif
@@ -4,18 +4,26 @@
 //  Students need to implement various Branch Predictors  //
 //========================================================//
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <thread>
 #include "predictor.h"
+#include "trace.h"
+#include "sweep.h"
+#include "indirect.h"
 
-// temp solution to compile
-#include <iostream>
-#include <sstream> // For std::istringstream
-
-FILE *stream;
-char *buf = NULL;
-size_t len = 0;
+TraceReader *trace;
+int pipeline;
+const char *cacheDir;
+uint64_t skipCount;
+uint64_t maxCount;
+int runTypes[NUM_BP_TYPES]; // predictors run side by side, if more than bpType
+int numRuns;
+int sweepThreads;
+int indirect; // also predict indirect targets
 
 // Print out the Usage information to stderr
 //
@@ -23,14 +31,79 @@ void usage()
 {
   fprintf(stderr, "Usage: predictor <options> [<trace>]\n");
   fprintf(stderr, "       bunzip2 -kc trace.bz2 | predictor <options>\n");
+  fprintf(stderr, " <trace> may be a plain trace file or one compressed with bzip2, zstd or lz4\n");
   fprintf(stderr, " Options:\n");
   fprintf(stderr, " --help       Print this message\n");
   fprintf(stderr, " --verbose    Print predictions on stdout\n");
+  fprintf(stderr, " --pipeline   Decode the trace on a separate thread\n");
+  fprintf(stderr, " --cache=<dir> Keep decoded copies of trace files in <dir>\n");
+  fprintf(stderr, " --skip=<n>   Skip the first <n> trace records (fast with <trace>.idx)\n");
+  fprintf(stderr, " --max=<n>    Simulate at most <n> trace records\n");
+  fprintf(stderr, " --prefetch=<n> Prefetch table entries <n> conditional branches ahead\n");
+  fprintf(stderr, " --indirect   Also predict the targets of indirect jumps and calls (ITTAGE)\n");
   fprintf(stderr, " --<type>     Branch prediction scheme:\n");
   fprintf(stderr, "    static\n"
                   "    gshare\n"
                   "    tournament\n"
-                  "    custom\n");
+                  "    custom\n"
+                  "    tage\n"
+                  "    perceptron\n"
+                  "    mpp         hashed perceptron\n");
+  fprintf(stderr, " --mpp-features=<f>,<f>,...\n"
+                  "              Feature tables of mpp: g<a>-<b>, l<n>, p<n>, depth, bias\n");
+  fprintf(stderr, " --predictors=<type>,<type>,...\n"
+                  "              Run several schemes over one pass of the trace\n");
+  fprintf(stderr, " --all        Run every scheme over one pass of the trace\n");
+  fprintf(stderr, " --sweep=<param>=<lo>:<hi>[:<step>] or --sweep=<param>=<v1>,<v2>,...\n"
+                  "              Evaluate the schemes at each value of <param> and print\n"
+                  "              a CSV of the results (may be repeated)\n");
+  fprintf(stderr, " --threads=<n> Threads used by --sweep (default: all cores)\n");
+}
+
+// Parse a non-negative branch count
+//
+// Returns True if Successful
+//
+int parse_count(const char *s, uint64_t *out)
+{
+  char *end;
+  if (*s < '0' || *s > '9')
+    return 0;
+  *out = strtoull(s, &end, 10);
+  return *end == '\0';
+}
+
+// Parse a comma separated list of predictor types into runTypes
+//
+// Returns True if Successful
+//
+int parse_predictors(const char *s)
+{
+  numRuns = 0;
+  while (*s)
+  {
+    size_t len = strcspn(s, ",");
+    int type = -1;
+    for (int t = 0; t < NUM_BP_TYPES; t++)
+    {
+      if (strlen(bpName[t]) == len && !strncasecmp(s, bpName[t], len))
+        type = t;
+    }
+    if (type < 0)
+      return 0;
+
+    // Each predictor runs once
+    int dup = 0;
+    for (int i = 0; i < numRuns; i++)
+      dup |= runTypes[i] == type;
+    if (!dup)
+      runTypes[numRuns++] = type;
+
+    s += len;
+    if (*s == ',')
+      s++;
+  }
+  return numRuns > 0;
 }
 
 // Process an option and update the predictor
@@ -56,62 +129,98 @@ int handle_option(char *arg)
   {
     bpType = CUSTOM;
   }
+  else if (!strcmp(arg, "--tage"))
+  {
+    bpType = TAGE;
+  }
+  else if (!strcmp(arg, "--perceptron"))
+  {
+    bpType = PERCEPTRON;
+  }
+  else if (!strcmp(arg, "--mpp"))
+  {
+    bpType = MPP;
+  }
+  else if (!strncmp(arg, "--mpp-features=", 15))
+  {
+    mppFeatures = arg + 15;
+    return mpp_features_valid(mppFeatures);
+  }
+  else if (!strcmp(arg, "--all"))
+  {
+    for (numRuns = 0; numRuns < NUM_BP_TYPES; numRuns++)
+      runTypes[numRuns] = numRuns;
+  }
+  else if (!strncmp(arg, "--predictors=", 13))
+  {
+    return parse_predictors(arg + 13);
+  }
+  else if (!strncmp(arg, "--sweep=", 8))
+  {
+    return sweep_add(arg + 8);
+  }
+  else if (!strncmp(arg, "--threads=", 10))
+  {
+    uint64_t n;
+    if (!parse_count(arg + 10, &n) || n == 0 || n > INT_MAX)
+      return 0;
+    sweepThreads = (int)n;
+  }
   else if (!strcmp(arg, "--verbose"))
   {
     verbose = 1;
   }
-  else
+  else if (!strcmp(arg, "--indirect"))
   {
-    return 0;
+    indirect = 1;
   }
-
-  return 1;
-}
-
-// Reads a line from the input stream and extracts the
-// PC and Outcome of a branch
-//
-// Returns True if Successful
-//
-/*int read_branch(uint32_t *pc, uint32_t *target, uint32_t *outcome, uint32_t *condition, uint32_t *call, uint32_t *ret, uint32_t *direct)
-{
-  if (getline(&buf, &len, stream) == -1)
+  else if (!strcmp(arg, "--pipeline"))
+  {
+    pipeline = 1;
+  }
+  else if (!strncmp(arg, "--cache=", 8) && arg[8])
+  {
+    cacheDir = arg + 8;
+  }
+  else if (!strncmp(arg, "--skip=", 7))
+  {
+    return parse_count(arg + 7, &skipCount);
+  }
+  else if (!strncmp(arg, "--max=", 6))
+  {
+    return parse_count(arg + 6, &maxCount);
+  }
+  else if (!strncmp(arg, "--prefetch=", 11))
+  {
+    uint64_t n;
+    if (!parse_count(arg + 11, &n) || n > BATCH_SIZE)
+      return 0;
+    prefetchDistance = (int)n;
+  }
+  else
   {
     return 0;
   }
 
-  sscanf(buf, "0x%x\t0x%x\t%d\t%d\t%d\t%d\t%d\n", pc, target, outcome, condition, call, ret, direct);
-
   return 1;
-}*/
-
-// Function to read and parse a branch line
-int read_branch(uint32_t* pc, uint32_t* target, uint32_t* outcome, uint32_t* condition,
-                uint32_t* call, uint32_t* ret, uint32_t* direct) {
-    static std::string buf; // Static buffer for reading lines
-    static std::istream& stream = std::cin; // Use standard input stream by default
-
-    // Read a line from the input stream
-    if (!std::getline(stream, buf)) {
-        return 0; // Return 0 if no more lines or an error occurs
-    }
-
-    // Parse the line using a string stream
-    std::istringstream iss(buf);
-    if (!(iss >> std::hex >> *pc >> *target >> std::dec >> *outcome >> *condition
-                >> *call >> *ret >> *direct)) {
-        return 0; // Return 0 if parsing fails
-    }
-
-    return 1; // Return 1 if parsing succeeds
 }
 
 int main(int argc, char *argv[])
 {
   // Set defaults
-  stream = stdin;
+  trace = NULL;
+  pipeline = 0;
+  indirect = 0;
+  cacheDir = NULL;
+  skipCount = 0;
+  maxCount = 0;
+  numRuns = 0;
+  sweepThreads = std::thread::hardware_concurrency();
   bpType = STATIC;
   verbose = 0;
+  prefetchDistance = 0;
+
+  const char *trace_path = NULL;
 
   // Process cmdline Arguments
   for (int i = 1; i < argc; ++i)
@@ -133,53 +242,147 @@ int main(int argc, char *argv[])
     else
     {
       // Use as input file
-      stream = fopen(argv[i], "r");
+      trace_path = argv[i];
     }
   }
 
-  // Initialize the predictor
-  init_predictor();
+  // Without a trace file, read the trace from standard input
+  if (!trace_path)
+  {
+    trace = trace_open(stdin);
+    trace->skip(skipCount);
+  }
+  else if (cacheDir)
+  {
+    trace = trace_open_cached(trace_path, cacheDir);
+    if (trace)
+      trace->skip(skipCount);
+  }
+  else
+  {
+    trace = trace_open_at(trace_path, skipCount);
+  }
+  if (!trace)
+  {
+    fprintf(stderr, "Unable to open trace %s\n", trace_path);
+    exit(1);
+  }
+  if (pipeline)
+  {
+    trace = trace_pipeline(trace);
+  }
+
+  // Initialize the predictors, each with its own state
+  if (numRuns == 0)
+  {
+    runTypes[numRuns++] = bpType;
+  }
+  if (sweep_size() > 0)
+  {
+    if (indirect)
+      fprintf(stderr, "--indirect is not supported with --sweep\n");
+    int ok = sweep_run(trace, maxCount, runTypes, numRuns, sweepThreads, stdout);
+    delete trace;
+    return ok ? 0 : 1;
+  }
+  Predictor *predictors[NUM_BP_TYPES];
+  for (int k = 0; k < numRuns; k++)
+  {
+    predictors[k] = predictor_create(runTypes[k]);
+  }
 
   uint32_t num_branches = 0;
-  uint32_t mispredictions = 0;
-  uint32_t pc = 0;
-  uint32_t target = 0;
-  uint32_t outcome = NOTTAKEN;
-  uint32_t condition = 0;
-  uint32_t call = 0;
-  uint32_t ret = 0;
-  uint32_t direct = 0;
-
-  // Reach each branch from the trace
-  while (read_branch(&pc, &target, &outcome, &condition, &call, &ret, &direct))
-  {
-    if (condition == 1)
+  uint32_t mispredictions[NUM_BP_TYPES] = {0};
+  branch_batch_t *batch = (branch_batch_t *)malloc(sizeof(branch_batch_t));
+  history_stream_t *stream = (history_stream_t *)malloc(sizeof(history_stream_t));
+  uint8_t (*predictions)[BATCH_SIZE] = (uint8_t(*)[BATCH_SIZE])malloc(numRuns * BATCH_SIZE);
+  uint64_t history = predictors[0]->history();
+  IttagePredictor *ittage = indirect ? new IttagePredictor() : NULL;
+  uint64_t num_records = 0;
+  uint64_t num_indirect = 0;
+  uint64_t wrong_targets = 0;
+
+  // Reach each batch of branches from the trace
+  uint64_t left = maxCount ? maxCount : UINT64_MAX;
+  while (left > 0 && trace->next_batch(batch))
+  {
+    if (batch->count > left)
+      batch->count = left;
+    left -= batch->count;
+    num_records += batch->count;
+
+    // The conditional branches and their global histories, once for
+    // all the predictors
+    history_stream_build(batch, history, stream);
+    history = stream->final_history;
+    num_branches += stream->count;
+
+    // Make predictions, compare with actual outcomes and train
+    for (int k = 0; k < numRuns; k++)
     {
-      num_branches++;
-      // Make a prediction and compare with actual outcome
-      uint32_t prediction = make_prediction(pc, target, direct);
-      if (prediction != outcome)
-      {
-        mispredictions++;
-      }
-      if (verbose != 0)
+      mispredictions[k] += predictors[k]->predict_stream(stream, predictions[k]);
+    }
+    if (ittage)
+    {
+      wrong_targets += ittage->run(batch, &num_indirect);
+    }
+
+    if (verbose != 0)
+    {
+      for (size_t i = 0; i < stream->count; i++)
       {
-        printf("%d\n", prediction);
+        // One column per predictor
+        for (int k = 0; k < numRuns; k++)
+        {
+          printf(k + 1 < numRuns ? "%d\t" : "%d\n", predictions[k][i]);
+        }
       }
     }
-    // Train the predictor
-    train_predictor(pc, target, outcome, condition, call, ret, direct);
   }
 
   // Print out the mispredict statistics
   printf("Branches:        %10d\n", num_branches);
-  printf("Incorrect:       %10d\n", mispredictions);
-  float mispredict_rate = 1000 * ((float)mispredictions / (float)num_branches);
-  printf("Misprediction Rate: %7.3f\n", mispredict_rate);
+  if (numRuns == 1)
+  {
+    printf("Incorrect:       %10d\n", mispredictions[0]);
+    float mispredict_rate = 1000 * ((float)mispredictions[0] / (float)num_branches);
+    printf("Misprediction Rate: %7.3f\n", mispredict_rate);
+  }
+  else
+  {
+    printf("Predictor        Incorrect  Misprediction Rate  Storage (bits)\n");
+    for (int k = 0; k < numRuns; k++)
+    {
+      float mispredict_rate = 1000 * ((float)mispredictions[k] / (float)num_branches);
+      printf("%-12s    %10d  %18.3f  %14llu\n", predictors[k]->name(), mispredictions[k],
+             mispredict_rate, (unsigned long long)predictors[k]->storage_bits());
+    }
+  }
+
+  // Indirect targets per kilo-instruction, with the instructions of
+  // the part of the trace simulated if the trace has metadata
+  if (ittage)
+  {
+    trace_meta_t meta;
+    printf("Indirect:        %10llu\n", (unsigned long long)num_indirect);
+    printf("Wrong Targets:   %10llu\n", (unsigned long long)wrong_targets);
+    if (trace_path && trace_file_meta(trace_path, &meta) && meta.instructions && meta.cond + meta.uncond)
+    {
+      double instructions = (double)meta.instructions * num_records / (meta.cond + meta.uncond);
+      printf("Indirect MPKI:      %7.3f\n", 1000.0 * wrong_targets / instructions);
+    }
+    delete ittage;
+  }
 
   // Cleanup
-  fclose(stream);
-  free(buf);
+  for (int k = 0; k < numRuns; k++)
+  {
+    delete predictors[k];
+  }
+  free(predictions);
+  free(stream);
+  free(batch);
+  delete trace;
 
   return 0;
 }
@@ -0,0 +1,414 @@
+//========================================================//
+//  perceptron.cpp                                        //
+//  Perceptron kernels                                    //
+//                                                        //
+//  With AVX2 the inputs are spread to one byte each,     //
+//  -1 or +1, and the weights are multiplied by them with //
+//  vpsignb and summed in pairs with vpmaddubsw.          //
+//========================================================//
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "perceptron.h"
+
+typedef int (*output_fn)(const int8_t *w, uint64_t x);
+typedef void (*train_fn)(int8_t *w, uint64_t x, uint32_t up);
+typedef int (*step_fn)(int8_t *w, uint64_t x, uint32_t up, int theta);
+typedef void (*index_fn)(const mpp_features_t *f, const uint64_t (*sources)[MPP_SOURCES], const uint32_t *pc,
+                         size_t m, uint16_t (*offsets)[MPP_MAX_FEATURES]);
+typedef uint32_t (*run_fn)(int8_t *w, int n, const uint16_t (*offsets)[MPP_MAX_FEATURES],
+                           const uint8_t *outcomes, size_t m, mpp_threshold_t *threshold,
+                           uint8_t *predictions);
+
+// Odd multipliers hashing each feature table differently
+static const uint32_t MPP_HASH[MPP_MAX_FEATURES] = {
+    0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F, 0x165667B1, 0xD3A2646D, 0xFD7046C5, 0xB55A4F09,
+    0x7FEB352D, 0x846CA68B, 0xE9A3B5C7, 0x2C1B3C6D, 0x297A2D39, 0x68E31DA5, 0xA136AAAD, 0x9BE89A3F};
+
+// Mixes the PC into every feature value
+#define MPP_PC_HASH 0x2545F491u
+
+// Whether to train on a branch predicted 'prediction' with sum 'y',
+// adjusting the threshold first
+static inline int mpp_adjust(uint32_t up, int y, uint32_t prediction, mpp_threshold_t *threshold)
+{
+  if (prediction != up)
+  {
+    if (++threshold->count > 63)
+    {
+      threshold->theta++;
+      threshold->count = 0;
+    }
+    return 1;
+  }
+  if (abs(y) <= threshold->theta)
+  {
+    if (--threshold->count < -64)
+    {
+      threshold->theta--;
+      threshold->count = 0;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+//------------------------------------//
+//              Scalar                //
+//------------------------------------//
+
+static int output_scalar(const int8_t *w, uint64_t x)
+{
+  int y = 0;
+  for (int i = 0; i < PERCEPTRON_WEIGHTS; i++)
+  {
+    y += (x >> i) & 1 ? w[i] : -w[i];
+  }
+  return y;
+}
+
+static void train_scalar(int8_t *w, uint64_t x, uint32_t up)
+{
+  for (int i = 0; i < PERCEPTRON_WEIGHTS; i++)
+  {
+    // +1 where the input agrees with the outcome
+    int d = (((x >> i) & 1) == up) ? 1 : -1;
+    int v = w[i] + d;
+    w[i] = v > PERCEPTRON_MAX ? PERCEPTRON_MAX : v < -PERCEPTRON_MAX ? -PERCEPTRON_MAX : v;
+  }
+}
+
+static int step_scalar(int8_t *w, uint64_t x, uint32_t up, int theta)
+{
+  int y = output_scalar(w, x);
+  if ((uint32_t)(y >= 0) != up || abs(y) <= theta)
+  {
+    train_scalar(w, x, up);
+  }
+  return y;
+}
+
+static void index_scalar(const mpp_features_t *f, const uint64_t (*sources)[MPP_SOURCES], const uint32_t *pc,
+                         size_t m, uint16_t (*offsets)[MPP_MAX_FEATURES])
+{
+  for (size_t k = 0; k < m; k++)
+  {
+    for (int t = 0; t < f->n; t++)
+    {
+      uint64_t x = (sources[k][f->source[t]] >> f->shift[t]) & f->mask[t];
+      uint32_t h = ((uint32_t)x ^ (uint32_t)(x >> 32) ^ pc[k] * MPP_PC_HASH) * MPP_HASH[t];
+      offsets[k][t] = (t << f->bits) | (h >> (32 - f->bits));
+    }
+  }
+}
+
+static uint32_t run_scalar(int8_t *w, int n, const uint16_t (*offsets)[MPP_MAX_FEATURES],
+                           const uint8_t *outcomes, size_t m, mpp_threshold_t *threshold,
+                           uint8_t *predictions)
+{
+  uint32_t mispredictions = 0;
+  for (size_t k = 0; k < m; k++)
+  {
+    int y = 0;
+    for (int t = 0; t < n; t++)
+    {
+      y += w[offsets[k][t]];
+    }
+    uint32_t prediction = y >= 0;
+    predictions[k] = prediction;
+    mispredictions += prediction != outcomes[k];
+    if (mpp_adjust(outcomes[k], y, prediction, threshold))
+    {
+      for (int t = 0; t < n; t++)
+      {
+        int8_t *x = &w[offsets[k][t]];
+        *x += outcomes[k] ? (*x < MPP_WEIGHT_MAX) : -(*x > -MPP_WEIGHT_MAX - 1);
+      }
+    }
+  }
+  return mispredictions;
+}
+
+//------------------------------------//
+//               AVX2                 //
+//------------------------------------//
+
+// Inputs 0-31 and 32-63 of 'x' as bytes, -1 where the input is +1 and
+// +1 where it is -1: the bytes are 0xFF where the bit is set, then
+// or'ed with 1
+__attribute__((target("avx2"))) static inline void inputs_avx2(uint64_t x, __m256i *lo, __m256i *hi)
+{
+  const __m256i spreadLo = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+  const __m256i spreadHi = _mm256_setr_epi8(4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5,
+                                            6, 6, 6, 6, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7);
+  const __m256i bit = _mm256_set1_epi64x(0x8040201008040201ll);
+  const __m256i one = _mm256_set1_epi8(1);
+  __m256i v = _mm256_set1_epi64x(x);
+  __m256i l = _mm256_and_si256(_mm256_shuffle_epi8(v, spreadLo), bit);
+  __m256i h = _mm256_and_si256(_mm256_shuffle_epi8(v, spreadHi), bit);
+  *lo = _mm256_or_si256(_mm256_cmpeq_epi8(l, bit), one);
+  *hi = _mm256_or_si256(_mm256_cmpeq_epi8(h, bit), one);
+}
+
+// Sum of the weights 'w0' and 'w1' times the inputs 'lo' and 'hi' as
+// inputs_avx2() spreads them
+__attribute__((target("avx2"))) static inline int dot_avx2(__m256i w0, __m256i w1, __m256i lo, __m256i hi)
+{
+  const __m256i ones8 = _mm256_set1_epi8(1);
+  const __m256i ones16 = _mm256_set1_epi16(1);
+
+  // Weights times -inputs, pairs summed to 16 bits (at most 254, no
+  // saturation), then to 32 bits
+  __m256i p0 = _mm256_sign_epi8(w0, lo);
+  __m256i p1 = _mm256_sign_epi8(w1, hi);
+  __m256i s = _mm256_add_epi16(_mm256_maddubs_epi16(ones8, p0), _mm256_maddubs_epi16(ones8, p1));
+  s = _mm256_madd_epi16(s, ones16);
+  __m128i t = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+  t = _mm_add_epi32(t, _mm_shuffle_epi32(t, 0x4E));
+  t = _mm_add_epi32(t, _mm_shuffle_epi32(t, 0xB1));
+  return -_mm_cvtsi128_si32(t);
+}
+
+// Train weights 'w0' and 'w1' on inputs 'lo' and 'hi' and store them
+// to 'w'
+__attribute__((target("avx2"))) static inline void train_vectors(int8_t *w, __m256i w0, __m256i w1,
+                                                                 __m256i lo, __m256i hi, uint32_t up)
+{
+  const __m256i floor = _mm256_set1_epi8(-PERCEPTRON_MAX);
+
+  // The bytes hold -inputs: subtract them to add the inputs
+  if (up)
+  {
+    w0 = _mm256_subs_epi8(w0, lo);
+    w1 = _mm256_subs_epi8(w1, hi);
+  }
+  else
+  {
+    w0 = _mm256_adds_epi8(w0, lo);
+    w1 = _mm256_adds_epi8(w1, hi);
+  }
+  _mm256_store_si256((__m256i *)w, _mm256_max_epi8(w0, floor));
+  _mm256_store_si256((__m256i *)(w + 32), _mm256_max_epi8(w1, floor));
+}
+
+__attribute__((target("avx2"))) static int output_avx2(const int8_t *w, uint64_t x)
+{
+  __m256i lo, hi;
+  inputs_avx2(x, &lo, &hi);
+  return dot_avx2(_mm256_load_si256((const __m256i *)w), _mm256_load_si256((const __m256i *)(w + 32)), lo, hi);
+}
+
+__attribute__((target("avx2"))) static void train_avx2(int8_t *w, uint64_t x, uint32_t up)
+{
+  __m256i lo, hi;
+  inputs_avx2(x, &lo, &hi);
+  train_vectors(w, _mm256_load_si256((const __m256i *)w), _mm256_load_si256((const __m256i *)(w + 32)),
+                lo, hi, up);
+}
+
+// Inputs spread and weights loaded once for both
+__attribute__((target("avx2"))) static int step_avx2(int8_t *w, uint64_t x, uint32_t up, int theta)
+{
+  __m256i lo, hi;
+  inputs_avx2(x, &lo, &hi);
+  __m256i w0 = _mm256_load_si256((const __m256i *)w);
+  __m256i w1 = _mm256_load_si256((const __m256i *)(w + 32));
+  int y = dot_avx2(w0, w1, lo, hi);
+  if ((uint32_t)(y >= 0) != up || abs(y) <= theta)
+  {
+    train_vectors(w, w0, w1, lo, hi, up);
+  }
+  return y;
+}
+
+// Four features from the source words 'src': vpermd picks the word of
+// each, vpsrlvq and a mask cut out the feature, and the 64-bit value is
+// folded into its low half
+__attribute__((target("avx2"))) static inline __m256i features_avx2(__m256i src, __m256i select, __m256i shift,
+                                                                    __m256i mask)
+{
+  __m256i x = _mm256_and_si256(_mm256_srlv_epi64(_mm256_permutevar8x32_epi32(src, select), shift), mask);
+  return _mm256_xor_si256(x, _mm256_srli_epi64(x, 32));
+}
+
+__attribute__((target("avx2"))) static void index_avx2(const mpp_features_t *f,
+                                                       const uint64_t (*sources)[MPP_SOURCES],
+                                                       const uint32_t *pc, size_t m,
+                                                       uint16_t (*offsets)[MPP_MAX_FEATURES])
+{
+  const __m256i hash0 = _mm256_loadu_si256((const __m256i *)MPP_HASH);
+  const __m256i hash1 = _mm256_loadu_si256((const __m256i *)(MPP_HASH + 8));
+  const __m128i bits = _mm_cvtsi32_si128(f->bits);
+  const __m128i drop = _mm_cvtsi32_si128(32 - f->bits);
+  const __m256i table0 = _mm256_sll_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), bits);
+  const __m256i table1 = _mm256_add_epi32(table0, _mm256_set1_epi32(8 << f->bits));
+  const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+  __m256i select[4], shift[4], mask[4];
+  for (int g = 0; g < 4; g++)
+  {
+    const uint32_t *s = &f->source[4 * g];
+    select[g] = _mm256_setr_epi32(2 * s[0], 2 * s[0] + 1, 2 * s[1], 2 * s[1] + 1,
+                                  2 * s[2], 2 * s[2] + 1, 2 * s[3], 2 * s[3] + 1);
+    shift[g] = _mm256_loadu_si256((const __m256i *)&f->shift[4 * g]);
+    mask[g] = _mm256_loadu_si256((const __m256i *)&f->mask[4 * g]);
+  }
+
+  // Only the groups of four features in use are hashed
+  if (f->n <= 8)
+  {
+    for (size_t k = 0; k < m; k++)
+    {
+      __m256i src = _mm256_loadu_si256((const __m256i *)sources[k]);
+      __m256i v0 = features_avx2(src, select[0], shift[0], mask[0]);
+      __m256i v1 = f->n > 4 ? features_avx2(src, select[1], shift[1], mask[1]) : v0;
+      __m256i p = _mm256_set1_epi32(pc[k] * MPP_PC_HASH);
+      __m256i h0 = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(v0), _mm256_castsi256_ps(v1), 0x88));
+      h0 = _mm256_xor_si256(_mm256_permutevar8x32_epi32(h0, order), p);
+      h0 = _mm256_srl_epi32(_mm256_mullo_epi32(h0, hash0), drop);
+      h0 = _mm256_or_si256(h0, table0);
+      __m128i o = _mm_packus_epi32(_mm256_castsi256_si128(h0), _mm256_extracti128_si256(h0, 1));
+      _mm_storeu_si128((__m128i *)offsets[k], o);
+    }
+    return;
+  }
+
+  for (size_t k = 0; k < m; k++)
+  {
+    __m256i src = _mm256_loadu_si256((const __m256i *)sources[k]);
+    __m256i v0 = features_avx2(src, select[0], shift[0], mask[0]);
+    __m256i v1 = features_avx2(src, select[1], shift[1], mask[1]);
+    __m256i v2 = features_avx2(src, select[2], shift[2], mask[2]);
+    __m256i v3 = f->n > 12 ? features_avx2(src, select[3], shift[3], mask[3]) : v2;
+
+    // The low halves of features 0-7 and 8-15, in order
+    __m256i p = _mm256_set1_epi32(pc[k] * MPP_PC_HASH);
+    __m256i h0 = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(v0), _mm256_castsi256_ps(v1), 0x88));
+    __m256i h1 = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(v2), _mm256_castsi256_ps(v3), 0x88));
+    h0 = _mm256_xor_si256(_mm256_permutevar8x32_epi32(h0, order), p);
+    h1 = _mm256_xor_si256(_mm256_permutevar8x32_epi32(h1, order), p);
+    h0 = _mm256_srl_epi32(_mm256_mullo_epi32(h0, hash0), drop);
+    h1 = _mm256_srl_epi32(_mm256_mullo_epi32(h1, hash1), drop);
+    h0 = _mm256_or_si256(h0, table0);
+    h1 = _mm256_or_si256(h1, table1);
+
+    // The pack interleaves the 128-bit halves
+    __m256i o = _mm256_permute4x64_epi64(_mm256_packus_epi32(h0, h1), 0xD8);
+    _mm256_storeu_si256((__m256i *)offsets[k], o);
+  }
+}
+
+// The sum is one gather per eight tables, the weight in the low byte
+// of each 32-bit word read
+__attribute__((target("avx2"))) static uint32_t run_avx2(int8_t *w, int n,
+                                                         const uint16_t (*offsets)[MPP_MAX_FEATURES],
+                                                         const uint8_t *outcomes, size_t m,
+                                                         mpp_threshold_t *threshold, uint8_t *predictions)
+{
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i live0 = _mm256_cmpgt_epi32(_mm256_set1_epi32(n), lanes);
+  __m256i live1 = _mm256_cmpgt_epi32(_mm256_set1_epi32(n - 8), lanes);
+  const __m256i top = _mm256_set1_epi32(MPP_WEIGHT_MAX);
+  const __m256i bottom = _mm256_set1_epi32(-MPP_WEIGHT_MAX - 1);
+  uint32_t mispredictions = 0;
+  for (size_t k = 0; k < m; k++)
+  {
+    __m256i o0 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)offsets[k]));
+    __m256i g0 = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *)w, o0, live0, 1);
+    __m256i g1 = _mm256_setzero_si256();
+    g0 = _mm256_srai_epi32(_mm256_slli_epi32(g0, 24), 24);
+    __m256i s = g0;
+    if (n > 8)
+    {
+      __m256i o1 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&offsets[k][8]));
+      g1 = _mm256_mask_i32gather_epi32(g1, (const int *)w, o1, live1, 1);
+      g1 = _mm256_srai_epi32(_mm256_slli_epi32(g1, 24), 24);
+      s = _mm256_add_epi32(g0, g1);
+    }
+    __m128i t = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+    t = _mm_add_epi32(t, _mm_shuffle_epi32(t, 0x4E));
+    t = _mm_add_epi32(t, _mm_shuffle_epi32(t, 0xB1));
+    int y = _mm_cvtsi128_si32(t);
+
+    uint32_t prediction = y >= 0;
+    predictions[k] = prediction;
+    mispredictions += prediction != outcomes[k];
+    if (mpp_adjust(outcomes[k], y, prediction, threshold))
+    {
+      // The weights are trained in the vectors and stored a byte at a
+      // time
+      __m256i d = _mm256_set1_epi32(outcomes[k] ? 1 : -1);
+      g0 = _mm256_max_epi32(_mm256_min_epi32(_mm256_add_epi32(g0, d), top), bottom);
+      g1 = _mm256_max_epi32(_mm256_min_epi32(_mm256_add_epi32(g1, d), top), bottom);
+      __m256i h = _mm256_permute4x64_epi64(_mm256_packs_epi32(g0, g1), 0xD8);
+      int8_t trained[MPP_MAX_FEATURES];
+      _mm_storeu_si128((__m128i *)trained,
+                       _mm_packs_epi16(_mm256_castsi256_si128(h), _mm256_extracti128_si256(h, 1)));
+      for (int t = 0; t < n; t++)
+      {
+        w[offsets[k][t]] = trained[t];
+      }
+    }
+  }
+  return mispredictions;
+}
+
+//------------------------------------//
+//             Interface              //
+//------------------------------------//
+
+// The kernels for this CPU
+static struct perceptron_kernels
+{
+  output_fn output;
+  train_fn train;
+  step_fn step;
+  index_fn index;
+  run_fn run;
+
+  perceptron_kernels()
+  {
+    const char *cap = getenv("BP_PERCEPTRON_SIMD");
+    __builtin_cpu_init();
+    output = output_scalar;
+    train = train_scalar;
+    step = step_scalar;
+    index = index_scalar;
+    run = run_scalar;
+    if ((!cap || strcmp(cap, "scalar")) && __builtin_cpu_supports("avx2"))
+    {
+      output = output_avx2;
+      train = train_avx2;
+      step = step_avx2;
+      index = index_avx2;
+      run = run_avx2;
+    }
+  }
+} kernels;
+
+int perceptron_output(const int8_t *w, uint64_t x)
+{
+  return kernels.output(w, x);
+}
+
+void perceptron_train(int8_t *w, uint64_t x, uint32_t up)
+{
+  kernels.train(w, x, up);
+}
+
+int perceptron_step(int8_t *w, uint64_t x, uint32_t up, int theta)
+{
+  return kernels.step(w, x, up, theta);
+}
+
+void mpp_index(const mpp_features_t *f, const uint64_t (*sources)[MPP_SOURCES], const uint32_t *pc, size_t m,
+               uint16_t (*offsets)[MPP_MAX_FEATURES])
+{
+  kernels.index(f, sources, pc, m, offsets);
+}
+
+uint32_t mpp_run(int8_t *w, int n, const uint16_t (*offsets)[MPP_MAX_FEATURES], const uint8_t *outcomes,
+                 size_t m, mpp_threshold_t *threshold, uint8_t *predictions)
+{
+  return kernels.run(w, n, offsets, outcomes, m, threshold, predictions);
+}
@@ -0,0 +1,117 @@
+//========================================================//
+//  perceptron.h                                          //
+//  Header file for the perceptron kernels                //
+//                                                        //
+//  A perceptron row is 64 int8 weights, a bias and one   //
+//  per bit of global history, in two AVX2 vectors; a     //
+//  hashed perceptron sums one weight from each of up to  //
+//  16 feature tables                                     //
+//========================================================//
+
+#ifndef PERCEPTRON_H
+#define PERCEPTRON_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Weights of a row: the bias, then history bits 0 to 62
+#define PERCEPTRON_WEIGHTS 64
+
+// Weights stay in -PERCEPTRON_MAX..PERCEPTRON_MAX so that negating one
+// can't overflow
+#define PERCEPTRON_MAX 127
+
+// The inputs of a row for global history 'history': the bias input
+// in bit 0, history bit i in bit i + 1. A set bit is +1, a clear one -1.
+//
+static inline uint64_t perceptron_inputs(uint64_t history)
+{
+  return (history << 1) | 1;
+}
+
+// Sum of the weights of row 'w' (32-byte aligned) times inputs 'x'
+//
+int perceptron_output(const int8_t *w, uint64_t x);
+
+// Move every weight of row 'w' towards agreeing with 'up' (1 for
+// taken): add input i to weight i if 'up' is 1, subtract it if 0,
+// saturating at +-PERCEPTRON_MAX. Uses AVX2 where the CPU supports it
+// unless BP_PERCEPTRON_SIMD=scalar is set in the environment.
+//
+void perceptron_train(int8_t *w, uint64_t x, uint32_t up);
+
+// perceptron_output() of row 'w' for inputs 'x', then, if the sign of
+// the output disagrees with 'up' or its magnitude is at most 'theta',
+// perceptron_train() with 'up'. Returns the output before training.
+//
+int perceptron_step(int8_t *w, uint64_t x, uint32_t up, int theta);
+
+//------------------------------------//
+//         Hashed Perceptron          //
+//------------------------------------//
+
+// Most feature tables of a hashed perceptron, two AVX2 vectors of 8
+#define MPP_MAX_FEATURES 16
+
+// log2 of the weights of a hashed perceptron, shared out evenly among
+// its feature tables, so that fewer features get bigger tables
+#define MPP_WEIGHT_BITS 15
+
+// Hashed perceptron weights are 6 bits, -MPP_WEIGHT_MAX-1..MPP_WEIGHT_MAX
+#define MPP_WEIGHT_MAX 31
+
+// Training threshold of a hashed perceptron, adjusted as it runs so
+// that it trains about as often on low confidence as on mispredictions
+typedef struct
+{
+  int theta;
+  int count;
+} mpp_threshold_t;
+
+// Where a feature comes from, one of four 64-bit words kept for each
+// branch
+enum
+{
+  MPP_GLOBAL, // global history
+  MPP_LOCAL,  // history of the branch itself
+  MPP_PATH,   // targets of the last taken branches
+  MPP_FOLDED, // calls less returns in bits 0-15, then up to three
+              // longer global history segments folded to 16 bits each
+  MPP_SOURCES
+};
+
+// The features of a hashed perceptron. Feature t is the bits mask[t]
+// of word source[t] shifted right by shift[t], folded to 32 bits; a
+// mask of 0 gives a bias, indexed by the PC alone. Features n and up
+// are unused. Each table has 2^bits weights, n << bits at most
+// 2^MPP_WEIGHT_BITS.
+typedef struct
+{
+  int n;
+  int bits;
+  uint32_t source[MPP_MAX_FEATURES];
+  uint64_t shift[MPP_MAX_FEATURES];
+  uint64_t mask[MPP_MAX_FEATURES];
+} mpp_features_t;
+
+// For each of 'm' branches, fill offsets[k][t] with the weight used by
+// feature t of 'f': its value from sources[k], hashed with pc[k] into
+// table t, which starts at t << f->bits. Only the f->n features
+// in use are filled in.
+//
+void mpp_index(const mpp_features_t *f, const uint64_t (*sources)[MPP_SOURCES], const uint32_t *pc, size_t m,
+               uint16_t (*offsets)[MPP_MAX_FEATURES]);
+
+// Predict and train on 'm' branches in order. Branch k sums the weights
+// of 'w' at offsets[k][0] to offsets[k][n - 1], predicts taken if the
+// sum is not negative into predictions[k], and trains on outcomes[k] if
+// that is wrong or the sum is within the threshold. 'w' must have 3
+// bytes of padding for whole-word reads. Uses AVX2 where the CPU
+// supports it unless BP_PERCEPTRON_SIMD=scalar is set.
+//
+// Returns the number of mispredictions
+//
+uint32_t mpp_run(int8_t *w, int n, const uint16_t (*offsets)[MPP_MAX_FEATURES], const uint8_t *outcomes,
+                 size_t m, mpp_threshold_t *threshold, uint8_t *predictions);
+
+#endif
@@ -7,7 +7,12 @@
 //========================================================//
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
+#include <emmintrin.h>
 #include "predictor.h"
+#include "counter.h"
+#include "perceptron.h"
+#include "folded.h"
 
 //
 // TODO:Student Information
@@ -21,13 +26,15 @@ const char *email = "riqin@ucsd.edu";
 //------------------------------------//
 
 // Handy Global for use in output routines
-const char *bpName[4] = {"Static", "Gshare",
-                         "Tournament", "Custom"};
+const char *bpName[NUM_BP_TYPES] = {"Static", "Gshare",
+                         "Tournament", "Custom", "TAGE",
+                         "Perceptron", "MPP"};
 
 // define number of bits required for indexing the BHT here.
 int ghistoryBits = 17; // Number of bits used for Global History
 int bpType;            // Branch Prediction Type
 int verbose;
+int prefetchDistance;
 
 int ghistoryBitsT = 16;
 int lhistoryBits = 12; // number of bits for local history
@@ -38,329 +45,1202 @@ int exceptionBits = 12; // bits for exception table
 int ghistoryBitsYAGS = 16;
 int tagBits = 15;
 
-//------------------------------------//
-//      Predictor Data Structures     //
-//------------------------------------//
-
-//
-// TODO: Add your own Branch Predictor data structures here
-//
-// gshare
-uint8_t *bht_gshare; // global predictor
-uint64_t ghistory; // GHR: tracks outcomes of last N branches
+// Index of each parameter in bpParams
+enum
+{
+  P_GHISTORY,
+  P_GHISTORY_T,
+  P_LHISTORY,
+  P_PCINDEX,
+  P_MUX,
+  P_EXCEPTION,
+  P_GHISTORY_YAGS
+};
 
-// Tournament: choose btwn local and global predicts
-uint8_t *bht_tourney; // global predictor
-// use same GHR
-uint8_t *lht; // LHT: store recent outcomes specific to branch (pc)
-uint8_t *local_pht;
-uint8_t *mux; // choose between global and local predictor; "chooser"
-              // 0=strong local, 1=weak local, 2=weak global, 3=strong global
-
-// custom (YAGS)
-// use gshare as base predictor
-uint8_t *T_exceptions; // tab;e for alternate taken predictions
-uint8_t *NT_exceptions; // table for alternate not taken predictions
-uint32_t *tags; // table for tags of exception table entries
+const bp_param_t bpParams[NUM_BP_PARAMS] = {
+    {"ghistoryBits", &ghistoryBits, 1 << GSHARE},
+    {"ghistoryBitsT", &ghistoryBitsT, 1 << TOURNAMENT},
+    {"lhistoryBits", &lhistoryBits, 1 << TOURNAMENT},
+    {"pcIndexBits", &pcIndexBits, 1 << TOURNAMENT},
+    {"muxBits", &muxBits, 1 << TOURNAMENT},
+    {"exceptionBits", &exceptionBits, 1 << CUSTOM},
+    {"ghistoryBitsYAGS", &ghistoryBitsYAGS, 1 << CUSTOM},
+};
 
 //------------------------------------//
-//        Predictor Functions         //
+//      Predictor Data Structures     //
 //------------------------------------//
 
-// Initialize the predictor
-//
+Predictor *predictor;
 
-// gshare functions
-void init_gshare()
+// The run() of a predictor that has no use for the precomputed
+// histories beyond prefetching: step() through the stream
+template <class P>
+static uint32_t run_steps(P &p, const history_stream_t *s, uint8_t *predictions)
 {
-  int bht_entries = 1 << ghistoryBits;
-  bht_gshare = (uint8_t *)malloc(bht_entries * sizeof(uint8_t));
-  int i = 0;
-  for (i = 0; i < bht_entries; i++)
+  uint32_t mispredictions = 0;
+  for (size_t k = 0; k < s->count; k++)
   {
-    bht_gshare[i] = WN;
+    if (prefetchDistance && k + prefetchDistance < s->count)
+    {
+      p.prefetch(s->pc[k + prefetchDistance], s->history[k + prefetchDistance]);
+    }
+    predictions[k] = p.step(s->pc[k], s->outcome[k]);
+    mispredictions += (predictions[k] != s->outcome[k]);
   }
-  ghistory = 0;
+  return mispredictions;
 }
 
-uint8_t gshare_predict(uint32_t pc)
+// Static: always taken
+class StaticPredictor
 {
-  // get lower ghistoryBits of pc
-  uint32_t bht_entries = 1 << ghistoryBits;
-  uint32_t pc_lower_bits = pc & (bht_entries - 1);
-  uint32_t ghistory_lower_bits = ghistory & (bht_entries - 1);
-  uint32_t index = pc_lower_bits ^ ghistory_lower_bits;
-  switch (bht_gshare[index])
-  {
-  case WN:
-    return NOTTAKEN;
-  case SN:
-    return NOTTAKEN;
-  case WT:
-    return TAKEN;
-  case ST:
-    return TAKEN;
-  default:
-    printf("Warning: Undefined state of entry in GSHARE BHT!\n");
-    return NOTTAKEN;
-  }
-}
+public:
+  uint8_t predict(uint32_t pc) { return TAKEN; }
+  void update(uint32_t pc, uint8_t outcome) {}
+  uint8_t step(uint32_t pc, uint8_t outcome) { return TAKEN; }
+  void reset() {}
+  uint64_t storage_bits() const { return 0; }
+  uint64_t history() const { return 0; }
+  void track(uint32_t pc, uint32_t target, uint8_t flags) {}
+  void prefetch(uint32_t pc, uint64_t history) const {}
+  uint32_t run(const history_stream_t *s, uint8_t *predictions) { return run_steps(*this, s, predictions); }
+};
 
-void train_gshare(uint32_t pc, uint8_t outcome)
+// gshare: a table of 2-bit counters indexed by PC xor global history
+class GsharePredictor
 {
-  // get lower ghistoryBits of pc
-  uint32_t bht_entries = 1 << ghistoryBits;
-  uint32_t pc_lower_bits = pc & (bht_entries - 1);
-  uint32_t ghistory_lower_bits = ghistory & (bht_entries - 1);
-  uint32_t index = pc_lower_bits ^ ghistory_lower_bits;
-
-  // Update state of entry in bht based on outcome
-  switch (bht_gshare[index])
-  {
-  case WN:
-    bht_gshare[index] = (outcome == TAKEN) ? WT : SN;
-    break;
-  case SN:
-    bht_gshare[index] = (outcome == TAKEN) ? WN : SN;
-    break;
-  case WT:
-    bht_gshare[index] = (outcome == TAKEN) ? ST : WN;
-    break;
-  case ST:
-    bht_gshare[index] = (outcome == TAKEN) ? ST : WT;
-    break;
-  default:
-    printf("Warning: Undefined state of entry in GSHARE BHT!\n");
-    break;
+public:
+  GsharePredictor(int historyBits)
+      : historyBits(historyBits), mask((1 << historyBits) - 1), bht(historyBits)
+  {
+    reset();
   }
 
-  // Update history register
-  ghistory = ((ghistory << 1) | outcome);
-}
+  void reset()
+  {
+    // init predictor (weakly not taken)
+    bht.fill(WN);
+    ghistory = 0;
+  }
 
-// Tournament functions ***************************************
-void init_tournament()
-{
-  int bht_entries = 1 << ghistoryBitsT;
-  int lht_entries = 1 << pcIndexBits;
-  int lpht_entries = 1 << lhistoryBits;
-  int mux_entries = 1 << muxBits;
-    
-  // table setup
-  bht_tourney = (uint8_t *)malloc(bht_entries * sizeof(uint8_t));
-  local_pht = (uint8_t *)malloc(lpht_entries * sizeof(uint8_t));
-  lht = (uint8_t *)malloc(lht_entries * sizeof(uint8_t));
-  mux = (uint8_t *)malloc(mux_entries * sizeof(uint8_t));
+  uint8_t predict(uint32_t pc)
+  {
+    return bht.taken(index(pc));
+  }
+
+  void update(uint32_t pc, uint8_t outcome)
+  {
+    bht.update(index(pc), outcome);
 
-  // init predictors (weakly not taken)
-  for (int i = 0; i < bht_entries; i++) {
-    bht_tourney[i] = WN;
+    // Update history register
+    ghistory = ((ghistory << 1) | outcome);
   }
-  for (int i = 0; i < lpht_entries; i++) {
-    local_pht[i] = WN;
+
+  uint8_t step(uint32_t pc, uint8_t outcome)
+  {
+    uint8_t prediction = bht.taken_update(index(pc), outcome);
+    ghistory = ((ghistory << 1) | outcome);
+    return prediction;
   }
-  for (int i = 0; i < lht_entries; i++) {
-    lht[i] = 0;
+
+  uint64_t storage_bits() const
+  {
+    return 2 * bht.size() + historyBits;
   }
 
-  // init mux (weak local predictor)
-  for (int i = 0; i < mux_entries; i++) {
-    mux[i] = 1;
+  uint64_t history() const { return ghistory; }
+
+  void track(uint32_t pc, uint32_t target, uint8_t flags) {}
+
+  void prefetch(uint32_t pc, uint64_t history) const
+  {
+    bht.prefetch((pc ^ history) & mask);
   }
-  ghistory = 0;
-}
 
-uint8_t tournament_predict(uint32_t pc)
-{
-  uint32_t bht_entries = 1 << ghistoryBitsT;
-  uint32_t lht_entries = 1 << pcIndexBits;
-  uint32_t mux_entries = 1 << muxBits;
+  uint32_t run(const history_stream_t *s, uint8_t *predictions)
+  {
+    uint32_t index[BATCH_SIZE];
+    history_stream_index(s, mask, index);
 
-  uint32_t global_index = (pc ^ ghistory) & (bht_entries - 1);
-  uint32_t local_index = lht[pc & (lht_entries - 1)] & (bht_entries - 1);
-  uint32_t mux_index = pc & (mux_entries - 1);
+    // Only the counters are left to read and update
+    uint32_t mispredictions = 0;
+    for (size_t k = 0; k < s->count; k++)
+    {
+      if (prefetchDistance && k + prefetchDistance < s->count)
+      {
+        bht.prefetch(index[k + prefetchDistance]);
+      }
+      predictions[k] = bht.taken_update(index[k], s->outcome[k]);
+      mispredictions += (predictions[k] != s->outcome[k]);
+    }
+    ghistory = s->final_history;
+    return mispredictions;
+  }
 
-  // predict!
-  uint8_t global_pred = (bht_tourney[global_index] == WT || bht_tourney[global_index] == ST) ? TAKEN : NOTTAKEN;
-  uint8_t local_pred = (local_pht[local_index] == WT || local_pht[local_index] == ST) ? TAKEN : NOTTAKEN;
-  uint8_t choice = mux[mux_index];
+private:
+  int historyBits;
+  uint32_t mask;     // of the table index
+  CounterTable bht;  // global predictor
+  uint64_t ghistory; // GHR: tracks outcomes of last N branches
 
-  // choose between predictors
-  return (choice >= 2) ? global_pred : local_pred;
-}
+  uint32_t index(uint32_t pc) const
+  {
+    // lower historyBits of pc xor history
+    return (pc ^ ghistory) & mask;
+  }
+};
 
-void train_tournament(uint32_t pc, uint8_t outcome)
+// Tournament: choose btwn local and global predicts
+class TournamentPredictor
 {
-  uint32_t bht_entries = 1 << ghistoryBitsT;
-  uint32_t lht_entries = 1 << pcIndexBits;
-  uint32_t mux_entries = 1 << muxBits;
+public:
+  TournamentPredictor(int historyBits, int localHistoryBits, int pcBits, int chooserBits)
+      : historyBits(historyBits), localHistoryBits(localHistoryBits), pcBits(pcBits),
+        chooserBits(chooserBits), mask((1 << historyBits) - 1),
+        localMask(mask & ((1 << localHistoryBits) - 1)), pcMask((1 << pcBits) - 1),
+        chooserMask((1 << chooserBits) - 1), bht(historyBits), local_pht(localHistoryBits),
+        mux(chooserBits)
+  {
+    lht = (uint8_t *)malloc((1 << pcBits) * sizeof(uint8_t));
+    reset();
+  }
+  ~TournamentPredictor()
+  {
+    free(lht);
+  }
 
-  uint32_t global_index = (pc ^ ghistory) & (bht_entries - 1);
-  uint32_t local_index = lht[pc & (lht_entries - 1)] & (bht_entries - 1);
-  uint32_t mux_index = pc & (mux_entries - 1);
+  void reset()
+  {
+    // init predictors (weakly not taken)
+    bht.fill(WN);
+    local_pht.fill(WN);
+    for (int i = 0; i < (1 << pcBits); i++) {
+      lht[i] = 0;
+    }
+
+    // init mux (weak local predictor)
+    mux.fill(1);
+    ghistory = 0;
+  }
 
-  // predict!
-  uint8_t global_pred = (bht_tourney[global_index] == WT || bht_tourney[global_index] == ST) ? TAKEN : NOTTAKEN;
-  uint8_t local_pred = (local_pht[local_index] == WT || local_pht[local_index] == ST) ? TAKEN : NOTTAKEN;
+  uint8_t predict(uint32_t pc)
+  {
+    uint8_t global_pred = bht.taken(global_index(pc));
+    uint8_t local_pred = local_pht.taken(local_index(pc));
 
-  // mux update state
-  if (global_pred == outcome && local_pred != outcome) {
-    // lean global
-    if (mux[mux_index] < 3) mux[mux_index]++;
-  } else if (global_pred != outcome && local_pred == outcome) {
-    // lean local
-    if (mux[mux_index] > 0) mux[mux_index]--;
+    // choose between predictors
+    return mux.taken(pc & chooserMask) ? global_pred : local_pred;
   }
 
-  // local update state
-  if (outcome == TAKEN) {
-    if (local_pht[local_index] < ST) local_pht[local_index]++;
-  } else {
-    if (local_pht[local_index] > SN) local_pht[local_index]--;
+  void update(uint32_t pc, uint8_t outcome)
+  {
+    uint32_t gi = global_index(pc);
+    uint32_t li = local_index(pc);
+    uint8_t global_pred = bht.taken(gi);
+    uint8_t local_pred = local_pht.taken(li);
+
+    // mux update state: lean towards whichever was right when they disagree
+    if (global_pred != local_pred) {
+      mux.update(pc & chooserMask, global_pred == outcome);
+    }
+
+    local_pht.update(li, outcome);
+    bht.update(gi, outcome);
+
+    // update LHT
+    // (old bits) | outcome
+    uint8_t *local = &lht[pc & pcMask];
+    *local = ((*local << 1) | outcome);
+
+    // update global history register
+    ghistory = ((ghistory << 1) | outcome);
   }
 
-  // global update state
-  if (outcome == TAKEN) {
-    if (bht_tourney[global_index] < ST) bht_tourney[global_index]++;
-  } else {
-    if (bht_tourney[global_index] > SN) bht_tourney[global_index]--;
+  uint8_t step(uint32_t pc, uint8_t outcome)
+  {
+    uint8_t prediction = step_at(pc, global_index(pc), outcome);
+    ghistory = ((ghistory << 1) | outcome);
+    return prediction;
   }
 
+  uint64_t storage_bits() const
+  {
+    // Local histories are 8 bits wide, whatever localHistoryBits is
+    return 2 * bht.size() + 2 * local_pht.size() + 8 * ((uint64_t)1 << pcBits) + 2 * mux.size() +
+           historyBits;
+  }
 
-  // update LHT
-  // (old bits) | outcome
-  lht[pc & (lht_entries - 1)] = ((lht[pc & (lht_entries - 1)] << 1) | outcome);
+  uint64_t history() const { return ghistory; }
 
-  // update global history register
-  ghistory = ((ghistory << 1) | outcome);
-}
+  void track(uint32_t pc, uint32_t target, uint8_t flags) {}
 
-// Custom (YAGS) ***********************************************
-void init_yags() {
-  int bht_entries = 1 << ghistoryBitsYAGS;
-  int exception_size = 1 << exceptionBits;
+  // The local PHT index depends on local history not yet written, but
+  // the local PHT is small
+  void prefetch(uint32_t pc, uint64_t history) const
+  {
+    bht.prefetch((pc ^ history) & mask);
+    mux.prefetch(pc & chooserMask);
+    __builtin_prefetch(&lht[pc & pcMask], 1);
+  }
 
-  bht_gshare = (uint8_t *)malloc(bht_entries * sizeof(uint8_t));
-  T_exceptions = (uint8_t *)malloc(exception_size * sizeof(uint8_t));
-  NT_exceptions = (uint8_t *)malloc(exception_size * sizeof(uint8_t));
-  tags = (uint32_t *)malloc(exception_size * sizeof(uint32_t));
+  uint32_t run(const history_stream_t *s, uint8_t *predictions)
+  {
+    uint32_t index[BATCH_SIZE];
+    history_stream_index(s, mask, index);
 
-  // init predictor (gshare) (weakly NT)
-  for (int i = 0; i < bht_entries; i++) {
-      bht_gshare[i] = WN;
+    uint32_t mispredictions = 0;
+    for (size_t k = 0; k < s->count; k++)
+    {
+      if (prefetchDistance && k + prefetchDistance < s->count)
+      {
+        prefetch(s->pc[k + prefetchDistance], s->history[k + prefetchDistance]);
+      }
+      predictions[k] = step_at(s->pc[k], index[k], s->outcome[k]);
+      mispredictions += (predictions[k] != s->outcome[k]);
+    }
+    ghistory = s->final_history;
+    return mispredictions;
   }
 
-  // init exception tables
-  for (int i = 0; i < exception_size; i++) {
-      T_exceptions[i] = WN;
-      NT_exceptions[i] = WN;
-      tags[i] = 0xFFFFFFFF; // init to some invalid tag
+private:
+  int historyBits;
+  int localHistoryBits;
+  int pcBits;
+  int chooserBits;
+  uint32_t mask;
+  uint32_t localMask;
+  uint32_t pcMask;
+  uint32_t chooserMask;
+  CounterTable bht;       // global predictor
+  CounterTable local_pht;
+  CounterTable mux;       // choose between global and local predictor; "chooser"
+                          // 0=strong local, 1=weak local, 2=weak global, 3=strong global
+  uint8_t *lht;           // LHT: store recent outcomes specific to branch (pc)
+  uint64_t ghistory;
+
+  uint32_t global_index(uint32_t pc) const
+  {
+    return (pc ^ ghistory) & mask;
   }
-  ghistory = 0;
-}
 
-uint8_t yags_predict(uint32_t pc) {
-  uint32_t bht_entries = 1 << ghistoryBitsYAGS;
-  uint32_t exception_entries = 1 << exceptionBits;
+  uint32_t local_index(uint32_t pc) const
+  {
+    // Also kept inside the local PHT when it is smaller than 256 entries
+    return lht[pc & pcMask] & localMask;
+  }
 
-  /*uint32_t pc_lower_bits = pc & (bht_entries - 1);
-  uint32_t ghistory_lower_bits = ghistory & (bht_entries - 1);
-  uint32_t bht_index = pc_lower_bits ^ ghistory_lower_bits;*/
+  // step() at global index 'gi', but for the global history
+  uint8_t step_at(uint32_t pc, uint32_t gi, uint8_t outcome)
+  {
+    uint8_t *local = &lht[pc & pcMask];
+    uint32_t ci = pc & chooserMask;
+    uint8_t use_global = mux.taken(ci);
+    uint8_t global_pred = bht.taken_update(gi, outcome);
+    uint8_t local_pred = local_pht.taken_update(*local & localMask, outcome);
 
-  uint32_t bht_index = (pc ^ ghistory) & (bht_entries - 1);
-  uint32_t exception_index = (pc ^ ghistory) & (exception_entries - 1);
-  // let the lower PC bits be tag
-  uint32_t pc_tag = ((pc) & 0xFFFFF); 
+    if (global_pred != local_pred) {
+      mux.update(ci, global_pred == outcome);
+    }
+    *local = ((*local << 1) | outcome);
+    return use_global ? global_pred : local_pred;
+  }
 
-  // does an exception table entry override gshare?
-  if (tags[exception_index] == pc_tag) {
-      if (T_exceptions[exception_index] == WT || T_exceptions[exception_index] == ST)
-          return TAKEN;
-      if (NT_exceptions[exception_index] == WN || NT_exceptions[exception_index] == SN)
-          return NOTTAKEN;
+  // The tables are owned
+  TournamentPredictor(const TournamentPredictor &);
+  TournamentPredictor &operator=(const TournamentPredictor &);
+};
+
+// custom (YAGS): gshare as base predictor, with tagged exception tables
+// for the branches that go against it
+class YagsPredictor
+{
+public:
+  YagsPredictor(int historyBits, int exceptionBits)
+      : historyBits(historyBits), exceptionBits(exceptionBits), mask((1 << historyBits) - 1),
+        exceptionMask((1 << exceptionBits) - 1), bht(historyBits),
+        T_exceptions(exceptionBits), NT_exceptions(exceptionBits)
+  {
+    tags = (uint32_t *)malloc((1 << exceptionBits) * sizeof(uint32_t));
+    reset();
+  }
+  ~YagsPredictor()
+  {
+    free(tags);
   }
-  // use gshare
-  return (bht_gshare[bht_index] == WT || bht_gshare[bht_index] == ST) ? TAKEN : NOTTAKEN;
-}
 
-void train_yags(uint32_t pc, uint8_t outcome) {
-  uint32_t bht_entries = 1 << ghistoryBitsYAGS;
-  uint32_t exception_entries = 1 << exceptionBits;
+  void reset()
+  {
+    // init predictor (gshare) (weakly NT)
+    bht.fill(WN);
 
-  uint32_t bht_index = (pc ^ ghistory) & (bht_entries - 1);
-  uint32_t exception_index = (pc ^ ghistory) & (exception_entries - 1);
-  // let the lower PC bits be tag
-  uint32_t pc_tag = ((pc) & 0xFFFFF); 
+    // init exception tables
+    T_exceptions.fill(WN);
+    NT_exceptions.fill(WN);
+    for (int i = 0; i < (1 << exceptionBits); i++) {
+      tags[i] = 0xFFFFFFFF; // init to some invalid tag
+    }
+    ghistory = 0;
+  }
 
-  // gshare predict
-  uint8_t gshare_pred = (bht_gshare[bht_index] == WT || bht_gshare[bht_index] == ST) ? TAKEN : NOTTAKEN;
+  uint8_t predict(uint32_t pc)
+  {
+    uint32_t exception_index = (pc ^ ghistory) & exceptionMask;
 
-  // gshare RIGHT, update normally
-  if (gshare_pred == outcome) {
-    if (outcome == TAKEN) {
-      if (bht_gshare[bht_index] < ST) bht_gshare[bht_index]++;
-    } else {
-      if (bht_gshare[bht_index] > SN) bht_gshare[bht_index]--;
-    }
-  } else {
-    // gshare WRONG, update exception table
-    // less aggressive: update only if strongly mispredicts
-    //if (bht_gshare[bht_index] == SN || bht_gshare[bht_index] == ST) 
-    tags[exception_index] = pc_tag;
-
-    if (outcome == TAKEN) {
-      // taken exception++
-      T_exceptions[exception_index] = 
-          (T_exceptions[exception_index] < ST) ? (T_exceptions[exception_index] + 1) : ST;
+    // does an exception table entry override gshare?
+    if (tags[exception_index] == tag(pc)) {
+      if (T_exceptions.taken(exception_index))
+        return TAKEN;
+      if (!NT_exceptions.taken(exception_index))
+        return NOTTAKEN;
+    }
+    // use gshare
+    return bht.taken((pc ^ ghistory) & mask);
+  }
+
+  void update(uint32_t pc, uint8_t outcome)
+  {
+    uint32_t bht_index = (pc ^ ghistory) & mask;
+    uint32_t exception_index = (pc ^ ghistory) & exceptionMask;
+
+    if (bht.taken(bht_index) == outcome) {
+      // gshare RIGHT, update normally
+      bht.update(bht_index, outcome);
     } else {
-      // not taken exception--
-      NT_exceptions[exception_index] = 
-          (NT_exceptions[exception_index] > SN) ? (NT_exceptions[exception_index] - 1) : SN;
+      // gshare WRONG, update exception table
+      tags[exception_index] = tag(pc);
+      if (outcome == TAKEN) {
+        // taken exception++
+        T_exceptions.increment(exception_index);
+      } else {
+        // not taken exception--
+        NT_exceptions.decrement(exception_index);
+      }
     }
+    // update global history register
+    ghistory = ((ghistory << 1) | outcome);
   }
-  // update global history register
-  ghistory = ((ghistory << 1) | outcome);
-}
 
-void cleanup_yags()
+  // Once both are inlined the compiler already computes each index and
+  // reads each entry once; the hand-merged step ran slower
+  uint8_t step(uint32_t pc, uint8_t outcome)
+  {
+    uint8_t prediction = predict(pc);
+    update(pc, outcome);
+    return prediction;
+  }
+
+  uint64_t storage_bits() const
+  {
+    // Two counters and a 20-bit tag per exception entry
+    return 2 * bht.size() + (2 + 2 + 20) * ((uint64_t)1 << exceptionBits) + historyBits;
+  }
+
+  uint64_t history() const { return ghistory; }
+
+  void track(uint32_t pc, uint32_t target, uint8_t flags) {}
+
+  void prefetch(uint32_t pc, uint64_t history) const
+  {
+    uint32_t exception_index = (pc ^ history) & exceptionMask;
+    bht.prefetch((pc ^ history) & mask);
+    __builtin_prefetch(&tags[exception_index]);
+    T_exceptions.prefetch(exception_index);
+    NT_exceptions.prefetch(exception_index);
+  }
+
+  uint32_t run(const history_stream_t *s, uint8_t *predictions)
+  {
+    return run_steps(*this, s, predictions);
+  }
+
+private:
+  int historyBits;
+  int exceptionBits;
+  uint32_t mask;
+  uint32_t exceptionMask;
+  CounterTable bht;           // base gshare predictor
+  CounterTable T_exceptions;  // table for alternate taken predictions
+  CounterTable NT_exceptions; // table for alternate not taken predictions
+  uint32_t *tags;             // table for tags of exception table entries
+  uint64_t ghistory;
+
+  // let the lower PC bits be tag
+  static uint32_t tag(uint32_t pc) { return pc & 0xFFFFF; }
+
+  // The tables are owned
+  YagsPredictor(const YagsPredictor &);
+  YagsPredictor &operator=(const YagsPredictor &);
+};
+
+// TAGE: a bimodal base predictor and tagged banks indexed with
+// geometrically longer global histories. The longest history whose
+// tag matches provides the prediction.
+#define TAGE_BANKS 8
+#define TAGE_BANK_BITS 11 // log2 of the entries of a tagged bank
+#define TAGE_BASE_BITS 13 // log2 of the bimodal counters
+#define TAGE_AGE_BITS 18  // useful bits are halved every 2^18 branches
+
+class TagePredictor
 {
-    free(bht_gshare);
-    free(T_exceptions);
-    free(NT_exceptions);
+public:
+  TagePredictor() : base(TAGE_BASE_BITS)
+  {
+    size_t n = (size_t)TAGE_BANKS << TAGE_BANK_BITS;
+    tags = (uint16_t *)malloc(n * sizeof(uint16_t));
+    ctrs = (int8_t *)malloc(n);
+    useful = (uint8_t *)malloc(n);
+    // The index registers of the banks, then the two tag registers,
+    // eight to a vector
+    long_history_init(&hist);
+    for (int b = 0; b < TAGE_BANKS; b++)
+    {
+      tagMask[b] = (1 << TAG_BITS[b]) - 1;
+      long_history_fold(&hist, LENGTH[b], TAGE_BANK_BITS);
+    }
+    for (int b = 0; b < TAGE_BANKS; b++)
+    {
+      long_history_fold(&hist, LENGTH[b], TAG_BITS[b]);
+    }
+    for (int b = 0; b < TAGE_BANKS; b++)
+    {
+      long_history_fold(&hist, LENGTH[b], TAG_BITS[b] - 1);
+    }
+    reset();
+  }
+  ~TagePredictor()
+  {
     free(tags);
+    free(ctrs);
+    free(useful);
+  }
+
+  void reset()
+  {
+    size_t n = (size_t)TAGE_BANKS << TAGE_BANK_BITS;
+    base.fill(WN);
+    memset(tags, 0, n * sizeof(uint16_t));
+    memset(ctrs, 0, n);
+    memset(useful, 0, n);
+    long_history_clear(&hist);
+    path = 0;
+    ghistory = 0;
+    useAltOnNa = 0;
+    tick = 0;
+    seed = 1;
+  }
+
+  uint8_t predict(uint32_t pc)
+  {
+    lookup_t l;
+    lookup(pc, &l);
+    return l.prediction;
+  }
+
+  void update(uint32_t pc, uint8_t outcome)
+  {
+    lookup_t l;
+    lookup(pc, &l);
+    train(pc, &l, outcome);
+  }
+
+  uint8_t step(uint32_t pc, uint8_t outcome)
+  {
+    lookup_t l;
+    lookup(pc, &l);
+    train(pc, &l, outcome);
+    return l.prediction;
+  }
+
+  uint64_t storage_bits() const
+  {
+    uint64_t bits = 2 * base.size();
+    for (int b = 0; b < TAGE_BANKS; b++)
+    {
+      // Tag, 3-bit counter and 2-bit useful counter per entry, and
+      // the three folded registers of the bank
+      bits += (uint64_t)(TAG_BITS[b] + 3 + 2) << TAGE_BANK_BITS;
+      bits += TAGE_BANK_BITS + TAG_BITS[b] + TAG_BITS[b] - 1;
+    }
+    // Global and path history, use-alternate counter and age counter
+    return bits + LENGTH[TAGE_BANKS - 1] + 16 + 4 + TAGE_AGE_BITS;
+  }
+
+  uint64_t history() const { return ghistory; }
+
+  void track(uint32_t pc, uint32_t target, uint8_t flags) {}
+
+  // Only the bimodal index is known ahead; the tagged indices need
+  // the folded histories of the branches in between
+  void prefetch(uint32_t pc, uint64_t history) const
+  {
+    base.prefetch(pc & ((1 << TAGE_BASE_BITS) - 1));
+  }
+
+  uint32_t run(const history_stream_t *s, uint8_t *predictions)
+  {
+    return run_steps(*this, s, predictions);
+  }
+
+private:
+  static const int LENGTH[TAGE_BANKS];
+  static const int TAG_BITS[TAGE_BANKS];
+
+  // What every bank holds for one branch
+  typedef struct
+  {
+    uint16_t index[TAGE_BANKS];
+    uint16_t tag[TAGE_BANKS];
+    int provider;       // longest matching bank, -1 for none
+    int alt;            // next longest, -1 for none
+    uint8_t providerPred;
+    uint8_t altPred;
+    uint8_t prediction;
+  } lookup_t;
+
+  CounterTable base;
+  uint16_t *tags;   // bank b, entry i at (b << TAGE_BANK_BITS) | i
+  int8_t *ctrs;     // 3-bit signed counters
+  uint8_t *useful;  // 2-bit counters
+  uint16_t tagMask[TAGE_BANKS];
+  long_history_t hist; // global history and the folds of each bank
+  uint16_t path;
+  uint64_t ghistory;
+  int32_t useAltOnNa; // 4-bit signed: trust newly allocated entries less
+  uint32_t tick;
+  uint32_t seed;
+
+  static uint32_t entry(int b, uint32_t i) { return ((uint32_t)b << TAGE_BANK_BITS) | i; }
+
+  static int weak(int8_t c) { return c == 0 || c == -1; }
+
+  // Index and tag of every bank, eight 16-bit lanes at once, then the
+  // provider and alternate
+  void lookup(uint32_t pc, lookup_t *l) const
+  {
+    const __m128i pathMul = _mm_setr_epi16(1, 3, 5, 7, 9, 11, 13, 15);
+    __m128i pcIndex = _mm_set1_epi16((int16_t)(pc ^ (pc >> TAGE_BANK_BITS)));
+    __m128i pcTag = _mm_set1_epi16((int16_t)(pc >> 2 ^ pc >> 17));
+    __m128i index = _mm_xor_si128(pcIndex, _mm_loadu_si128((const __m128i *)&hist.value[0]));
+    index = _mm_xor_si128(index, _mm_mullo_epi16(_mm_set1_epi16((int16_t)path), pathMul));
+    index = _mm_and_si128(index, _mm_set1_epi16((1 << TAGE_BANK_BITS) - 1));
+    __m128i tag = _mm_xor_si128(pcTag, _mm_loadu_si128((const __m128i *)&hist.value[TAGE_BANKS]));
+    tag = _mm_xor_si128(tag, _mm_slli_epi16(_mm_loadu_si128((const __m128i *)&hist.value[2 * TAGE_BANKS]), 1));
+    tag = _mm_and_si128(tag, _mm_loadu_si128((const __m128i *)tagMask));
+    _mm_storeu_si128((__m128i *)l->index, index);
+    _mm_storeu_si128((__m128i *)l->tag, tag);
+
+    // From the longest history down, stopping at the second match (5 to
+    // 7 tags read on average). Gathering all eight tags into a vector
+    // for one compare, with pinsrw or an AVX2 gather, ran 15-25% slower:
+    // the gather costs more than the well-predicted branches here.
+    l->provider = l->alt = -1;
+    for (int b = TAGE_BANKS - 1; b >= 0; b--)
+    {
+      if (tags[entry(b, l->index[b])] == l->tag[b])
+      {
+        if (l->provider >= 0)
+        {
+          l->alt = b;
+          break;
+        }
+        l->provider = b;
+      }
+    }
+
+    uint8_t basePred = base.taken(pc & ((1 << TAGE_BASE_BITS) - 1));
+    l->altPred = l->alt < 0 ? basePred : ctrs[entry(l->alt, l->index[l->alt])] >= 0;
+    if (l->provider < 0)
+    {
+      l->providerPred = l->prediction = basePred;
+      return;
+    }
+    uint32_t e = entry(l->provider, l->index[l->provider]);
+    l->providerPred = ctrs[e] >= 0;
+    // A weak entry that has not proven useful is likely newly allocated
+    int fresh = weak(ctrs[e]) && useful[e] == 0;
+    l->prediction = fresh && useAltOnNa >= 0 ? l->altPred : l->providerPred;
+  }
+
+  void train(uint32_t pc, const lookup_t *l, uint8_t outcome)
+  {
+    int p = l->provider;
+    if (p >= 0)
+    {
+      uint32_t e = entry(p, l->index[p]);
+      int fresh = weak(ctrs[e]) && useful[e] == 0;
+      if (fresh && l->providerPred != l->altPred)
+      {
+        useAltOnNa = sctr_update<4>(useAltOnNa, l->altPred == outcome);
+      }
+    }
+
+    // On a misprediction take an entry in a longer bank
+    if (l->providerPred != outcome && p < TAGE_BANKS - 1)
+    {
+      allocate(l, outcome);
+    }
+
+    if (p >= 0)
+    {
+      uint32_t e = entry(p, l->index[p]);
+      // The alternate learns too while the provider is still unproven
+      if (useful[e] == 0 && weak(ctrs[e]))
+      {
+        if (l->alt >= 0)
+        {
+          uint32_t a = entry(l->alt, l->index[l->alt]);
+          ctrs[a] = sctr_update<3>(ctrs[a], outcome);
+        }
+        else
+        {
+          base.update(pc & ((1 << TAGE_BASE_BITS) - 1), outcome);
+        }
+      }
+      ctrs[e] = sctr_update<3>(ctrs[e], outcome);
+      if (l->providerPred != l->altPred)
+      {
+        useful[e] = ctr_update<2>(useful[e], l->providerPred == outcome);
+      }
+    }
+    else
+    {
+      base.update(pc & ((1 << TAGE_BASE_BITS) - 1), outcome);
+    }
+
+    if ((++tick & ((1 << TAGE_AGE_BITS) - 1)) == 0)
+    {
+      age();
+    }
+    push(pc, outcome);
+  }
+
+  // Claim the first entry not marked useful in a bank longer than the
+  // provider, sometimes skipping one so that allocations spread out,
+  // or wear down the useful counters of all of them if none is free
+  void allocate(const lookup_t *l, uint8_t outcome)
+  {
+    int first = l->provider + 1;
+    seed = seed * 1103515245 + 12345;
+    if (first < TAGE_BANKS - 1 && (seed >> 16) & 1)
+    {
+      first++;
+    }
+    for (int b = first; b < TAGE_BANKS; b++)
+    {
+      uint32_t e = entry(b, l->index[b]);
+      if (useful[e] == 0)
+      {
+        tags[e] = l->tag[b];
+        ctrs[e] = outcome ? 0 : -1;
+        return;
+      }
+    }
+    for (int b = l->provider + 1; b < TAGE_BANKS; b++)
+    {
+      uint32_t e = entry(b, l->index[b]);
+      useful[e] -= useful[e] != 0;
+    }
+  }
+
+  void age()
+  {
+    size_t n = (size_t)TAGE_BANKS << TAGE_BANK_BITS;
+    for (size_t i = 0; i < n; i++)
+    {
+      useful[i] >>= 1;
+    }
+  }
+
+  // Shift the outcome into the histories
+  void push(uint32_t pc, uint8_t outcome)
+  {
+    ghistory = (ghistory << 1) | outcome;
+    path = (path << 1) | ((pc >> 2) & 1);
+    long_history_push(&hist, outcome);
+  }
+
+  // The tables are owned
+  TagePredictor(const TagePredictor &);
+  TagePredictor &operator=(const TagePredictor &);
+};
+
+// History lengths from 5 to 200, about 1.7 times longer each bank,
+// and longer tags for the longer histories
+const int TagePredictor::LENGTH[TAGE_BANKS] = {5, 8, 14, 24, 41, 70, 118, 200};
+const int TagePredictor::TAG_BITS[TAGE_BANKS] = {8, 8, 9, 9, 10, 10, 11, 11};
+
+// Perceptron (Jimenez and Lin): a row of int8 weights per PC, whose
+// sum with the global history bits as +-1 inputs predicts taken when
+// it is not negative
+#define PERCEPTRON_ROW_BITS 9 // log2 of the rows
+#define PERCEPTRON_THETA 135  // training threshold, 1.93 * 63 + 14
+
+class PerceptronPredictor
+{
+public:
+  PerceptronPredictor()
+  {
+    // One row to a cache line
+    weights = (int8_t *)aligned_alloc(64, (size_t)PERCEPTRON_WEIGHTS << PERCEPTRON_ROW_BITS);
+    reset();
+  }
+  ~PerceptronPredictor()
+  {
+    free(weights);
+  }
+
+  void reset()
+  {
+    memset(weights, 0, (size_t)PERCEPTRON_WEIGHTS << PERCEPTRON_ROW_BITS);
+    ghistory = 0;
+  }
+
+  uint8_t predict(uint32_t pc)
+  {
+    return perceptron_output(row(pc), perceptron_inputs(ghistory)) >= 0;
+  }
+
+  void update(uint32_t pc, uint8_t outcome)
+  {
+    step(pc, outcome);
+  }
+
+  uint8_t step(uint32_t pc, uint8_t outcome)
+  {
+    // Trains on a misprediction or while the output is not confident
+    uint8_t prediction = perceptron_step(row(pc), perceptron_inputs(ghistory), outcome, PERCEPTRON_THETA) >= 0;
+    ghistory = (ghistory << 1) | outcome;
+    return prediction;
+  }
+
+  uint64_t storage_bits() const
+  {
+    // 8-bit weights and 63 bits of global history
+    return ((uint64_t)8 * PERCEPTRON_WEIGHTS << PERCEPTRON_ROW_BITS) + PERCEPTRON_WEIGHTS - 1;
+  }
+
+  uint64_t history() const { return ghistory; }
+
+  void track(uint32_t pc, uint32_t target, uint8_t flags) {}
+
+  void prefetch(uint32_t pc, uint64_t history) const
+  {
+    __builtin_prefetch(row(pc), 1);
+  }
+
+  uint32_t run(const history_stream_t *s, uint8_t *predictions)
+  {
+    return run_steps(*this, s, predictions);
+  }
+
+private:
+  int8_t *weights;
+  uint64_t ghistory;
+
+  int8_t *row(uint32_t pc) const
+  {
+    uint32_t i = (pc ^ (pc >> PERCEPTRON_ROW_BITS)) & ((1 << PERCEPTRON_ROW_BITS) - 1);
+    return &weights[(size_t)i * PERCEPTRON_WEIGHTS];
+  }
+
+  // The weights are owned
+  PerceptronPredictor(const PerceptronPredictor &);
+  PerceptronPredictor &operator=(const PerceptronPredictor &);
+};
+
+// Hashed perceptron with the feature kinds of the multiperspective
+// perceptron: one table of weights per feature, each indexed by a hash
+// of the PC and the feature. The features are read from mppFeatures.
+#define MPP_LOCAL_BITS 10 // log2 of the local histories
+#define MPP_PATH_BITS 4   // bits of each taken branch target in the path
+#define MPP_THETA 20      // initial training threshold
+#define MPP_CHUNK 256     // conditional branches indexed ahead in run()
+#define MPP_SEGMENTS 3    // global history segments past bit 64
+
+const char *mppFeatures = "bias,g0-8,g0-16,g8-32,g24-64,g0-64,l11,l16";
+
+static uint64_t low_bits(int n)
+{
+  return n == 64 ? ~0ull : (1ull << n) - 1;
 }
 
-void cleanup_gshare()
+// Parse a comma-separated list of features: g<a>-<b> for global
+// history bits a to b-1, l<n> for n bits of local history, p<n> for the
+// last n taken branch targets, depth and bias. Segments of global
+// history ending past bit 64 are folded from a long history; segment j
+// of those is bits segment[j][0] to segment[j][1]-1. The tables are
+// as big as n of them allow.
+//
+// Returns the number of features, 0 if 'spec' is not valid
+//
+static int mpp_parse(const char *spec, mpp_features_t *f, int *segments,
+                     int (*segment)[2])
 {
-  free(bht_gshare);
+  const char *p = spec;
+  memset(f, 0, sizeof(*f));
+  *segments = 0;
+  while (*p)
+  {
+    int t = f->n;
+    int a, b, len = 0;
+    if (t == MPP_MAX_FEATURES)
+      return 0;
+    if (sscanf(p, "g%d-%d%n", &a, &b, &len) == 2 && len && 0 <= a && a < b && b <= 64)
+    {
+      f->source[t] = MPP_GLOBAL;
+      f->shift[t] = a;
+      f->mask[t] = low_bits(b - a);
+    }
+    else if (len && 0 <= a && a < b && b < LONG_HISTORY && *segments < MPP_SEGMENTS)
+    {
+      segment[*segments][0] = a;
+      segment[*segments][1] = b;
+      f->source[t] = MPP_FOLDED;
+      f->shift[t] = 16 * ++*segments;
+      f->mask[t] = 0xFFFF;
+    }
+    else if (sscanf(p, "l%d%n", &a, &len) == 1 && len && 1 <= a && a <= 16)
+    {
+      f->source[t] = MPP_LOCAL;
+      f->mask[t] = low_bits(a);
+    }
+    else if (sscanf(p, "p%d%n", &a, &len) == 1 && len && 1 <= a && a * MPP_PATH_BITS <= 64)
+    {
+      f->source[t] = MPP_PATH;
+      f->mask[t] = low_bits(a * MPP_PATH_BITS);
+    }
+    else if (!strncmp(p, "depth", 5))
+    {
+      f->source[t] = MPP_FOLDED;
+      f->mask[t] = 0xFFFF;
+      len = 5;
+    }
+    else if (!strncmp(p, "bias", 4))
+    {
+      len = 4;
+    }
+    else
+    {
+      return 0;
+    }
+    p += len;
+    if (*p == ',')
+      p++;
+    else if (*p)
+      return 0;
+    f->n++;
+  }
+  f->bits = MPP_WEIGHT_BITS;
+  while (f->n << f->bits > 1 << MPP_WEIGHT_BITS)
+  {
+    f->bits--;
+  }
+  return f->n;
 }
 
-void cleanup_tournament()
+int mpp_features_valid(const char *spec)
 {
-  free(bht_tourney);
-  free(local_pht);
-  free(lht);
-  free(mux);
+  mpp_features_t f;
+  int segments, segment[MPP_SEGMENTS][2];
+  return mpp_parse(spec, &f, &segments, segment) > 0;
 }
 
-void init_predictor()
+class MppPredictor
 {
-  switch (bpType)
+public:
+  MppPredictor()
+  {
+    n = mpp_parse(mppFeatures, &features, &segments, segment);
+    tracking = 0;
+    for (int t = 0; t < n; t++)
+    {
+      tracking |= features.source[t] == MPP_PATH || (features.source[t] == MPP_FOLDED && features.shift[t] == 0);
+    }
+    long_history_init(&longHistory);
+    for (int j = 0; j < segments; j++)
+    {
+      for (int e = 0; e < 2; e++)
+      {
+        fold[j][e] = segment[j][e] ? long_history_fold(&longHistory, segment[j][e], 16) : -1;
+      }
+    }
+    weights = (int8_t *)malloc(weight_bytes());
+    memset(chunkSources, 0, sizeof(chunkSources));
+    reset();
+  }
+  ~MppPredictor()
+  {
+    free(weights);
+  }
+
+  void reset()
+  {
+    memset(weights, 0, weight_bytes());
+    memset(lht, 0, sizeof(lht));
+    long_history_clear(&longHistory);
+    ghistory = 0;
+    path = 0;
+    depth = 0;
+    threshold.theta = MPP_THETA;
+    threshold.count = 0;
+  }
+
+  uint8_t predict(uint32_t pc)
+  {
+    uint16_t offsets[1][MPP_MAX_FEATURES];
+    index(pc, offsets);
+    int y = 0;
+    for (int t = 0; t < n; t++)
+    {
+      y += weights[offsets[0][t]];
+    }
+    return y >= 0;
+  }
+
+  void update(uint32_t pc, uint8_t outcome)
+  {
+    step(pc, outcome);
+  }
+
+  uint8_t step(uint32_t pc, uint8_t outcome)
+  {
+    uint16_t offsets[1][MPP_MAX_FEATURES];
+    uint8_t prediction;
+    index(pc, offsets);
+    mpp_run(weights, n, offsets, &outcome, 1, &threshold, &prediction);
+    advance(pc, outcome);
+    return prediction;
+  }
+
+  uint64_t storage_bits() const
+  {
+    uint64_t bits = (uint64_t)6 * n << features.bits;
+    int longest = 0;
+    for (int t = 0; t < n; t++)
+    {
+      if (features.source[t] == MPP_LOCAL)
+      {
+        bits += 16 << MPP_LOCAL_BITS;
+        break;
+      }
+    }
+    // The long history and its folded registers
+    for (int j = 0; j < segments; j++)
+    {
+      longest = segment[j][1] > longest ? segment[j][1] : longest;
+      bits += 16 * (1 + (fold[j][0] >= 0));
+    }
+    // Global history, path history and call depth if tracked, threshold
+    // and its counter
+    return bits + longest + 64 + (tracking ? 64 + 6 : 0) + 8 + 7;
+  }
+
+  uint64_t history() const { return ghistory; }
+
+  void track(uint32_t pc, uint32_t target, uint8_t flags)
+  {
+    track_path(target, flags, &path, &depth);
+  }
+
+  // The weights also depend on the local and path histories, which
+  // the global history does not give
+  void prefetch(uint32_t pc, uint64_t history) const {}
+
+  // The features depend only on the trace, so those of MPP_CHUNK
+  // branches are hashed in one pass before their weights are summed.
+  // Their sources are filled in a pass per kind, so that each loop is
+  // short enough to stay in registers: the path and call depth, only
+  // when a feature reads them since every branch moves them, then the
+  // global history from 's' and the local histories, then the folded
+  // long history
+  uint32_t run(const history_stream_t *s, uint8_t *predictions)
+  {
+    const branch_batch_t *b = s->batch;
+    uint32_t mispredictions = 0;
+    size_t i = 0;
+    for (size_t k = 0; k < s->count; k += MPP_CHUNK)
+    {
+      size_t m = s->count - k < MPP_CHUNK ? s->count - k : MPP_CHUNK;
+      if (tracking)
+      {
+        i = track_chunk(b, i, m);
+      }
+      for (size_t j = 0; j < m; j++)
+      {
+        uint16_t *local = &lht[s->pc[k + j] & ((1 << MPP_LOCAL_BITS) - 1)];
+        chunkSources[j][MPP_GLOBAL] = s->history[k + j];
+        chunkSources[j][MPP_LOCAL] = *local;
+        *local = (*local << 1) | s->outcome[k + j];
+      }
+      for (size_t j = 0; segments && j < m; j++)
+      {
+        chunkSources[j][MPP_FOLDED] = (chunkSources[j][MPP_FOLDED] & 0xFFFF) | folded();
+        long_history_push(&longHistory, s->outcome[k + j]);
+      }
+      mpp_index(&features, chunkSources, &s->pc[k], m, chunkOffsets);
+      mispredictions += mpp_run(weights, n, chunkOffsets, &s->outcome[k], m, &threshold, &predictions[k]);
+    }
+    if (tracking)
+    {
+      track_chunk(b, i, 0);
+    }
+    ghistory = s->final_history;
+    return mispredictions;
+  }
+
+private:
+  int n;
+  mpp_features_t features;
+  int segments;
+  int segment[MPP_SEGMENTS][2];
+  int tracking; // whether a feature reads the path or call depth
+  int fold[MPP_SEGMENTS][2]; // registers of the segment ends, -1 for bit 0
+  long_history_t longHistory;
+  int8_t *weights; // table t from t << features.bits
+  uint16_t lht[1 << MPP_LOCAL_BITS];
+  uint64_t ghistory;
+  uint64_t path;
+  uint32_t depth;
+  mpp_threshold_t threshold;
+  uint64_t chunkSources[MPP_CHUNK][MPP_SOURCES];
+  uint16_t chunkOffsets[MPP_CHUNK][MPP_MAX_FEATURES];
+
+  // Padded for the whole-word reads of mpp_run()
+  size_t weight_bytes() const { return ((size_t)n << features.bits) + 4; }
+
+  // Move the path and call depth past a branch
+  static void track_path(uint32_t target, uint8_t flags, uint64_t *path, uint32_t *depth)
+  {
+    if (flags & BR_TAKEN)
+    {
+      *path = (*path << MPP_PATH_BITS) | ((target ^ (target >> MPP_PATH_BITS)) & ((1 << MPP_PATH_BITS) - 1));
+    }
+    *depth += (flags & BR_CALL) && *depth < 63;
+    *depth -= (flags & BR_RET) && *depth > 0;
+  }
+
+  // Move the path and call depth through the branches of 'b' from 'i',
+  // writing those before each of the next 'm' conditional branches to
+  // its sources without branching on which are conditional: every
+  // branch writes the sources of the next conditional one, which only
+  // that one keeps. With 'm' 0, to the end of 'b'.
+  //
+  // Returns the position after the m-th conditional branch
+  //
+  size_t track_chunk(const branch_batch_t *b, size_t i, size_t m)
+  {
+    uint64_t p = path;
+    uint32_t d = depth;
+    if (!m)
+    {
+      for (; i < b->count; i++)
+      {
+        track_path(b->target[i], b->flags[i], &p, &d);
+      }
+    }
+    for (size_t j = 0; j < m; i++)
+    {
+      uint8_t flags = b->flags[i];
+      chunkSources[j][MPP_PATH] = p;
+      chunkSources[j][MPP_FOLDED] = d;
+      track_path(b->target[i], flags, &p, &d);
+      j += (flags >> 1) & 1;
+    }
+    path = p;
+    depth = d;
+    return i;
+  }
+
+  // The folded long history segments, 16 bits each above the call depth
+  uint64_t folded() const
+  {
+    uint64_t x = 0;
+    for (int j = 0; j < segments; j++)
+    {
+      uint32_t v = longHistory.value[fold[j][1]] ^ (fold[j][0] >= 0 ? longHistory.value[fold[j][0]] : 0);
+      x |= (uint64_t)v << (16 * (j + 1));
+    }
+    return x;
+  }
+
+  // The words the features of a branch at 'pc' come from
+  void sources(uint32_t pc, uint64_t *w) const
+  {
+    w[MPP_GLOBAL] = ghistory;
+    w[MPP_LOCAL] = lht[pc & ((1 << MPP_LOCAL_BITS) - 1)];
+    w[MPP_PATH] = path;
+    w[MPP_FOLDED] = depth | folded();
+  }
+
+  void index(uint32_t pc, uint16_t (*offsets)[MPP_MAX_FEATURES]) const
+  {
+    uint64_t w[1][MPP_SOURCES];
+    sources(pc, w[0]);
+    mpp_index(&features, w, &pc, 1, offsets);
+  }
+
+  // Shift the outcome of a conditional branch at 'pc' into the histories
+  void advance(uint32_t pc, uint8_t outcome)
+  {
+    uint16_t *local = &lht[pc & ((1 << MPP_LOCAL_BITS) - 1)];
+    *local = (*local << 1) | outcome;
+    ghistory = (ghistory << 1) | outcome;
+    if (segments)
+    {
+      long_history_push(&longHistory, outcome);
+    }
+  }
+
+  // The tables are owned
+  MppPredictor(const MppPredictor &);
+  MppPredictor &operator=(const MppPredictor &);
+};
+
+//------------------------------------//
+//        Predictor Functions         //
+//------------------------------------//
+
+Predictor *predictor_create_with(int type, const int *values)
+{
+  switch (type)
   {
   case STATIC:
-    break;
+    return new PredictorDriver<StaticPredictor>(bpName[STATIC]);
   case GSHARE:
-    init_gshare();
-    break;
+    return new PredictorDriver<GsharePredictor>(bpName[GSHARE], values[P_GHISTORY]);
   case TOURNAMENT:
-    init_tournament();
-    break;
+    return new PredictorDriver<TournamentPredictor>(bpName[TOURNAMENT], values[P_GHISTORY_T],
+                                                    values[P_LHISTORY], values[P_PCINDEX], values[P_MUX]);
   case CUSTOM:
-    init_yags();
-    break;
+    return new PredictorDriver<YagsPredictor>(bpName[CUSTOM], values[P_GHISTORY_YAGS],
+                                              values[P_EXCEPTION]);
+  case TAGE:
+    return new PredictorDriver<TagePredictor>(bpName[TAGE]);
+  case PERCEPTRON:
+    return new PredictorDriver<PerceptronPredictor>(bpName[PERCEPTRON]);
+  case MPP:
+    return new PredictorDriver<MppPredictor>(bpName[MPP]);
   default:
-    break;
+    return NULL;
+  }
+}
+
+Predictor *predictor_create(int type)
+{
+  int values[NUM_BP_PARAMS];
+  for (int i = 0; i < NUM_BP_PARAMS; i++)
+  {
+    values[i] = *bpParams[i].value;
   }
+  return predictor_create_with(type, values);
+}
+
+// Initialize the predictor
+//
+void init_predictor()
+{
+  delete predictor;
+  predictor = predictor_create(bpType);
 }
 
 // Make a prediction for conditional branch instruction at PC 'pc'
@@ -369,24 +1249,8 @@ void init_predictor()
 //
 uint32_t make_prediction(uint32_t pc, uint32_t target, uint32_t direct)
 {
-
-  // Make a prediction based on the bpType
-  switch (bpType)
-  {
-  case STATIC:
-    return TAKEN;
-  case GSHARE:
-    return gshare_predict(pc);
-  case TOURNAMENT:
-    return tournament_predict(pc);
-  case CUSTOM:
-    return yags_predict(pc);
-  default:
-    break;
-  }
-
   // If there is not a compatable bpType then return NOTTAKEN
-  return NOTTAKEN;
+  return predictor ? predictor->predict(pc) : NOTTAKEN;
 }
 
 // Train the predictor the last executed branch at PC 'pc' and with
@@ -396,20 +1260,44 @@ uint32_t make_prediction(uint32_t pc, uint32_t target, uint32_t direct)
 
 void train_predictor(uint32_t pc, uint32_t target, uint32_t outcome, uint32_t condition, uint32_t call, uint32_t ret, uint32_t direct)
 {
-  if (condition)
+  if (condition && predictor)
   {
-    switch (bpType)
+    predictor->update(pc, outcome);
+  }
+  if (predictor)
+  {
+    branch_t br = {pc, target, outcome, condition, call, ret, direct};
+    int flags = pack_flags(&br);
+    predictor->track(pc, target, flags < 0 ? 0 : flags);
+  }
+}
+
+// Batch interface ********************************************
+
+uint32_t predict_batch(const branch_batch_t *b, uint8_t *predictions)
+{
+  if (predictor)
+  {
+    return predictor->predict_batch(b, predictions);
+  }
+
+  // Without a compatible bpType every branch is predicted NOTTAKEN
+  uint32_t mispredictions = 0;
+  for (size_t i = 0; i < b->count; i++)
+  {
+    if (predictions)
     {
-    case STATIC:
-      return;
-    case GSHARE:
-      return train_gshare(pc, outcome);
-    case TOURNAMENT:
-      return train_tournament(pc, outcome);
-    case CUSTOM:
-      return train_yags(pc, outcome);
-    default:
-      break;
+      predictions[i] = NOTTAKEN;
     }
+    mispredictions += (b->flags[i] & BR_COND) && (b->flags[i] & BR_TAKEN);
+  }
+  return mispredictions;
+}
+
+void train_batch(const branch_batch_t *b)
+{
+  if (predictor)
+  {
+    predictor->train_batch(b);
   }
 }
@@ -70,6 +70,238 @@ void train_predictor(uint32_t pc, uint32_t target, uint32_t outcome, uint32_t co
 // Please add your code below, and DO NOT MODIFY ANY OF THE CODE ABOVE
 // 
 
+#include "branch.h"
+#include "history.h"
+
+// TAGE, a reference for the custom predictor with the same budget
+#define TAGE 4
+
+// Perceptron with int8 weights, same budget
+#define PERCEPTRON 5
+
+// Hashed perceptron over configurable features, same budget
+#define MPP 6
+
+// Number of predictor types, STATIC to MPP, named in bpName[]
+#define NUM_BP_TYPES 7
+
+// Features of the hashed perceptron, a comma-separated list (see the
+// README), set by --mpp-features=
+extern const char *mppFeatures;
+
+// Returns True if 'spec' is a valid list of hashed perceptron features
+//
+int mpp_features_valid(const char *spec);
+
+// Conditional branches ahead of the current one whose table entries
+// are prefetched by predict_batch() (0 for none)
+extern int prefetchDistance;
+
+// A branch predictor with its own tables and history. Each kind of
+// predictor is a plain class providing
+//
+//   uint8_t predict(uint32_t pc)                 prediction for a conditional branch
+//   void update(uint32_t pc, uint8_t outcome)    train on its outcome
+//   uint8_t step(uint32_t pc, uint8_t outcome)   predict() then update(), with
+//                                                each index computed and each
+//                                                entry read once
+//   void reset()                                 back to the initial state
+//   uint64_t storage_bits() const                bits of predictor state
+//   uint64_t history() const                     global history register
+//   void track(uint32_t pc, uint32_t target, uint8_t flags)
+//                                                see every branch, BR_* bits in
+//                                                'flags', after step() or
+//                                                update() for conditional ones
+//   void prefetch(uint32_t pc, uint64_t history) prefetch the entries a branch
+//                                                at 'pc' will use once the
+//                                                global history is 'history'
+//   uint32_t run(const history_stream_t *s, uint8_t *predictions)
+//                                                step() through the branches of
+//                                                's', starting from history(),
+//                                                with prediction k in
+//                                                predictions[k], and track()
+//                                                through s->batch if it uses
+//                                                more than conditional
+//                                                branches; returns the number
+//                                                of mispredictions
+//
+// and is wrapped in a PredictorDriver, which runs whole batches through
+// step(), or whole history streams through run(), with one virtual call
+// per batch instead of one per branch.
+class Predictor
+{
+public:
+  virtual ~Predictor() {}
+  virtual const char *name() const = 0;
+  virtual uint8_t predict(uint32_t pc) = 0;
+  virtual void update(uint32_t pc, uint8_t outcome) = 0;
+  virtual void reset() = 0;
+  virtual uint64_t storage_bits() const = 0;
+
+  // Run a batch of branches through the predictor in trace order. Each
+  // conditional branch is predicted and then trained on. The
+  // prediction for branch i goes to predictions[i] (NOTTAKEN for
+  // unconditional branches) if 'predictions' isn't NULL.
+  //
+  // Returns the number of mispredicted conditional branches
+  //
+  virtual uint32_t predict_batch(const branch_batch_t *b, uint8_t *predictions) = 0;
+
+  // Train on a batch of branches without scoring them
+  //
+  virtual void train_batch(const branch_batch_t *b) = 0;
+
+  // Global history register, 0 after reset()
+  virtual uint64_t history() const = 0;
+
+  // See a branch of any kind, with its BR_* bits in 'flags', after
+  // update() if it is conditional
+  virtual void track(uint32_t pc, uint32_t target, uint8_t flags) = 0;
+
+  // As predict_batch() for the conditional branches of 's', which was
+  // built from history(). Prediction k goes to predictions[k]. Every
+  // predictor starts from the same history and shifts in the same
+  // outcomes, so one stream serves all of them.
+  //
+  // Returns the number of mispredicted conditional branches
+  //
+  virtual uint32_t predict_stream(const history_stream_t *s, uint8_t *predictions) = 0;
+};
+
+// The batch loops, compiled once for each predictor class P so that
+// its methods are inlined
+template <class P>
+class PredictorDriver : public Predictor
+{
+public:
+  template <typename... Args>
+  PredictorDriver(const char *name, Args... args) : label(name), impl(args...)
+  {
+  }
+  const char *name() const { return label; }
+  uint8_t predict(uint32_t pc) { return impl.predict(pc); }
+  void update(uint32_t pc, uint8_t outcome) { impl.update(pc, outcome); }
+  void reset() { impl.reset(); }
+  uint64_t storage_bits() const { return impl.storage_bits(); }
+  uint64_t history() const { return impl.history(); }
+  void track(uint32_t pc, uint32_t target, uint8_t flags) { impl.track(pc, target, flags); }
+
+  uint32_t predict_stream(const history_stream_t *s, uint8_t *predictions)
+  {
+    return impl.run(s, predictions);
+  }
+
+  uint32_t predict_batch(const branch_batch_t *b, uint8_t *predictions)
+  {
+    // The outcomes are known, so the global history ahead of the
+    // predictor is too: stay prefetchDistance conditional branches ahead
+    size_t ahead = 0;
+    uint64_t history = impl.history();
+    for (int d = 0; d < prefetchDistance; d++)
+    {
+      prefetch_next(b, &ahead, &history);
+    }
+
+    uint32_t mispredictions = 0;
+    for (size_t i = 0; i < b->count; i++)
+    {
+      uint8_t flags = b->flags[i];
+      uint8_t outcome = flags & BR_TAKEN;
+      uint8_t prediction = NOTTAKEN;
+      if (flags & BR_COND)
+      {
+        if (prefetchDistance)
+        {
+          prefetch_next(b, &ahead, &history);
+        }
+        prediction = impl.step(b->pc[i], outcome);
+        mispredictions += (prediction != outcome);
+      }
+      impl.track(b->pc[i], b->target[i], flags);
+      if (predictions)
+      {
+        predictions[i] = prediction;
+      }
+    }
+    return mispredictions;
+  }
+
+  void train_batch(const branch_batch_t *b)
+  {
+    for (size_t i = 0; i < b->count; i++)
+    {
+      if (b->flags[i] & BR_COND)
+      {
+        impl.update(b->pc[i], b->flags[i] & BR_TAKEN);
+      }
+      impl.track(b->pc[i], b->target[i], b->flags[i]);
+    }
+  }
+
+private:
+  const char *label;
+  P impl;
+
+  // Prefetch for the first conditional branch in 'b' from 'ahead' on,
+  // which the predictor will see with global history 'history', and
+  // move past it
+  void prefetch_next(const branch_batch_t *b, size_t *ahead, uint64_t *history)
+  {
+    while (*ahead < b->count && !(b->flags[*ahead] & BR_COND))
+    {
+      (*ahead)++;
+    }
+    if (*ahead < b->count)
+    {
+      impl.prefetch(b->pc[*ahead], *history);
+      *history = (*history << 1) | (b->flags[*ahead] & BR_TAKEN);
+      (*ahead)++;
+    }
+  }
+};
+
+// A table size or history length of the predictors
+typedef struct
+{
+  const char *name;
+  int *value; // the configuration global holding its default
+  int types;  // mask of (1 << type) for the predictor types using it
+} bp_param_t;
+
+#define NUM_BP_PARAMS 7
+extern const bp_param_t bpParams[NUM_BP_PARAMS];
+
+// Range of valid parameter values
+#define BP_PARAM_MIN 1
+#define BP_PARAM_MAX 28
+
+// Create a predictor of type 'type' (STATIC, GSHARE, ...) configured
+// from the globals above
+//
+// Returns NULL for an unknown type
+//
+Predictor *predictor_create(int type);
+
+// Create a predictor of type 'type' with values[i] for bpParams[i]
+//
+// Returns NULL for an unknown type
+//
+Predictor *predictor_create_with(int type, const int *values);
+
+// The predictor made by init_predictor() for bpType
+extern Predictor *predictor;
+
+// Run a batch of branches through the predictor in trace order, as
+// Predictor::predict_batch(). Without a predictor for bpType every
+// branch is predicted NOTTAKEN.
+//
+// Returns the number of mispredicted conditional branches
+//
+uint32_t predict_batch(const branch_batch_t *b, uint8_t *predictions);
+
+// Train the predictor on a batch of branches without scoring them
+//
+void train_batch(const branch_batch_t *b);
 
 
 #endif
@@ -0,0 +1,323 @@
+//========================================================//
+//  sweep.cpp                                             //
+//  Parameter sweep over predictor table sizes and        //
+//  history lengths                                       //
+//                                                        //
+//  The trace is decoded once into batches shared by all  //
+//  worker threads; each configuration is one job.        //
+//========================================================//
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "sweep.h"
+#include "lanes.h"
+
+// Values of the swept parameters, in the order they were added
+typedef struct
+{
+  int param; // index in bpParams
+  std::vector<int> values;
+} sweep_axis_t;
+
+static std::vector<sweep_axis_t> axes;
+
+// One predictor configuration and its result
+typedef struct
+{
+  int type;
+  int values[NUM_BP_PARAMS];
+  uint64_t mispredictions;
+  uint64_t storage;
+} sweep_job_t;
+
+// A unit of work for a thread: jobs[first] on its own, or up to
+// GSHARE_LANES gshare jobs from jobs[first] on run side by side
+typedef struct
+{
+  size_t first;
+  int count;
+} sweep_task_t;
+
+//------------------------------------//
+//          Sweep Definition          //
+//------------------------------------//
+
+// Parse a parameter value
+//
+// Returns True if Successful
+//
+static int parse_value(const char *s, const char **end, int *v)
+{
+  char *e;
+  if (*s < '0' || *s > '9')
+    return 0;
+  long n = strtol(s, &e, 10);
+  *end = e;
+  *v = (int)n;
+  return n >= BP_PARAM_MIN && n <= BP_PARAM_MAX;
+}
+
+int sweep_add(const char *spec)
+{
+  const char *eq = strchr(spec, '=');
+  if (!eq)
+    return 0;
+
+  sweep_axis_t axis;
+  axis.param = -1;
+  for (int i = 0; i < NUM_BP_PARAMS; i++)
+  {
+    if (strlen(bpParams[i].name) == (size_t)(eq - spec) && !strncmp(spec, bpParams[i].name, eq - spec))
+      axis.param = i;
+  }
+  for (size_t i = 0; i < axes.size(); i++)
+  {
+    if (axes[i].param == axis.param)
+      return 0;
+  }
+  if (axis.param < 0)
+    return 0;
+
+  const char *p = eq + 1;
+  int lo, hi, step = 1;
+  if (!parse_value(p, &p, &lo))
+    return 0;
+  if (*p == ':')
+  {
+    // A range
+    if (!parse_value(p + 1, &p, &hi) || hi < lo)
+      return 0;
+    if (*p == ':' && (!parse_value(p + 1, &p, &step) || step < 1))
+      return 0;
+    // Stop before a step past 'hi', which could overflow
+    for (int v = lo;; v += step)
+    {
+      axis.values.push_back(v);
+      if (hi - v < step)
+        break;
+    }
+  }
+  else
+  {
+    // A list
+    axis.values.push_back(lo);
+    while (*p == ',')
+    {
+      int v;
+      if (!parse_value(p + 1, &p, &v))
+        return 0;
+      axis.values.push_back(v);
+    }
+  }
+  if (*p != '\0')
+    return 0;
+
+  axes.push_back(axis);
+  return 1;
+}
+
+int sweep_size()
+{
+  return axes.size();
+}
+
+// Add a job for every combination of the swept parameters 'type'
+// uses, from axis 'a' on
+//
+static void add_jobs(int type, size_t a, int *values, std::vector<sweep_job_t> &jobs)
+{
+  if (a == axes.size())
+  {
+    sweep_job_t job;
+    job.type = type;
+    memcpy(job.values, values, sizeof(job.values));
+    job.mispredictions = 0;
+    job.storage = 0;
+    jobs.push_back(job);
+    return;
+  }
+  if (!(bpParams[axes[a].param].types & (1 << type)))
+  {
+    add_jobs(type, a + 1, values, jobs);
+    return;
+  }
+  for (size_t i = 0; i < axes[a].values.size(); i++)
+  {
+    values[axes[a].param] = axes[a].values[i];
+    add_jobs(type, a + 1, values, jobs);
+  }
+  values[axes[a].param] = *bpParams[axes[a].param].value;
+}
+
+//------------------------------------//
+//              Engine                //
+//------------------------------------//
+
+// Index in bpParams of the gshare history length
+//
+static int gshare_param()
+{
+  for (int i = 0; i < NUM_BP_PARAMS; i++)
+  {
+    if (bpParams[i].value == &ghistoryBits)
+      return i;
+  }
+  return 0;
+}
+
+// Run tasks, claimed one at a time, against the decoded trace
+//
+static void sweep_worker(const std::vector<branch_batch_t *> *batches, std::vector<sweep_job_t> *jobs,
+                         const std::vector<sweep_task_t> *tasks, std::atomic<size_t> *next)
+{
+  size_t t;
+  while ((t = (*next)++) < tasks->size())
+  {
+    const sweep_task_t &task = (*tasks)[t];
+    if (task.count > 1)
+    {
+      // gshare has no other parameter
+      int bits[GSHARE_LANES];
+      uint64_t mispredictions[GSHARE_LANES];
+      for (int l = 0; l < task.count; l++)
+      {
+        bits[l] = (*jobs)[task.first + l].values[gshare_param()];
+        mispredictions[l] = 0;
+      }
+      gshare_lanes_run(*batches, bits, task.count, mispredictions);
+      for (int l = 0; l < task.count; l++)
+      {
+        sweep_job_t &job = (*jobs)[task.first + l];
+        Predictor *p = predictor_create_with(job.type, job.values);
+        job.mispredictions = mispredictions[l];
+        job.storage = p->storage_bits();
+        delete p;
+      }
+      continue;
+    }
+
+    sweep_job_t &job = (*jobs)[task.first];
+    Predictor *p = predictor_create_with(job.type, job.values);
+    for (size_t i = 0; i < batches->size(); i++)
+    {
+      job.mispredictions += p->predict_batch((*batches)[i], NULL);
+    }
+    job.storage = p->storage_bits();
+    delete p;
+  }
+}
+
+// Split the jobs into tasks. Runs of gshare jobs are shared out over
+// the threads in groups of up to GSHARE_LANES, which take one pass
+// over the trace each.
+//
+static void add_tasks(const std::vector<sweep_job_t> &jobs, int threads, std::vector<sweep_task_t> &tasks)
+{
+  size_t j = 0;
+  while (j < jobs.size())
+  {
+    size_t n = 0;
+    while (j + n < jobs.size() && jobs[j + n].type == GSHARE)
+      n++;
+    size_t lanes = (n + threads - 1) / threads;
+    if (lanes > GSHARE_LANES)
+      lanes = GSHARE_LANES;
+    if (lanes < 1)
+      lanes = 1;
+    for (size_t end = j + n; j < end; j += lanes)
+    {
+      sweep_task_t task = {j, (int)(end - j < lanes ? end - j : lanes)};
+      tasks.push_back(task);
+    }
+    if (n == 0)
+    {
+      sweep_task_t task = {j++, 1};
+      tasks.push_back(task);
+    }
+  }
+}
+
+int sweep_run(TraceReader *trace, uint64_t max, const int *types, int numTypes, int threads,
+              FILE *out)
+{
+  // Every swept parameter must matter to some predictor
+  for (size_t a = 0; a < axes.size(); a++)
+  {
+    int used = 0;
+    for (int k = 0; k < numTypes; k++)
+      used |= bpParams[axes[a].param].types & (1 << types[k]);
+    if (!used)
+    {
+      fprintf(stderr, "No selected predictor uses %s\n", bpParams[axes[a].param].name);
+      return 0;
+    }
+  }
+
+  std::vector<sweep_job_t> jobs;
+  int values[NUM_BP_PARAMS];
+  for (int i = 0; i < NUM_BP_PARAMS; i++)
+    values[i] = *bpParams[i].value;
+  for (int k = 0; k < numTypes; k++)
+    add_jobs(types[k], 0, values, jobs);
+
+  // Decode the trace once
+  std::vector<branch_batch_t *> batches;
+  uint64_t num_branches = 0;
+  uint64_t left = max ? max : UINT64_MAX;
+  while (left > 0)
+  {
+    branch_batch_t *b = (branch_batch_t *)malloc(sizeof(branch_batch_t));
+    if (!trace->next_batch(b))
+    {
+      free(b);
+      break;
+    }
+    if (b->count > left)
+      b->count = left;
+    left -= b->count;
+    for (size_t i = 0; i < b->count; i++)
+      num_branches += (b->flags[i] & BR_COND) != 0;
+    batches.push_back(b);
+  }
+
+  if (threads < 1)
+    threads = 1;
+  if ((size_t)threads > jobs.size())
+    threads = jobs.size();
+  std::vector<sweep_task_t> tasks;
+  add_tasks(jobs, threads, tasks);
+  fprintf(stderr, "Sweeping %zu configurations on %d threads\n", jobs.size(), threads);
+
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++)
+    workers.push_back(std::thread(sweep_worker, &batches, &jobs, &tasks, &next));
+  for (size_t t = 0; t < workers.size(); t++)
+    workers[t].join();
+
+  for (size_t i = 0; i < batches.size(); i++)
+    free(batches[i]);
+
+  // Parameters a predictor doesn't use are left empty
+  fprintf(out, "predictor");
+  for (int i = 0; i < NUM_BP_PARAMS; i++)
+    fprintf(out, ",%s", bpParams[i].name);
+  fprintf(out, ",storage_bits,branches,incorrect,misprediction_rate\n");
+  for (size_t j = 0; j < jobs.size(); j++)
+  {
+    fprintf(out, "%s", bpName[jobs[j].type]);
+    for (int i = 0; i < NUM_BP_PARAMS; i++)
+    {
+      if (bpParams[i].types & (1 << jobs[j].type))
+        fprintf(out, ",%d", jobs[j].values[i]);
+      else
+        fprintf(out, ",");
+    }
+    float mispredict_rate = 1000 * ((float)jobs[j].mispredictions / (float)num_branches);
+    fprintf(out, ",%llu,%llu,%llu,%.3f\n", (unsigned long long)jobs[j].storage,
+            (unsigned long long)num_branches, (unsigned long long)jobs[j].mispredictions,
+            mispredict_rate);
+  }
+  return 1;
+}
@@ -0,0 +1,40 @@
+//========================================================//
+//  sweep.h                                               //
+//  Header file for the predictor parameter sweep         //
+//                                                        //
+//  Evaluates many predictor configurations against one   //
+//  decoded copy of a trace                               //
+//========================================================//
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "predictor.h"
+#include "trace.h"
+
+// Add the values of one parameter to the sweep, from a spec of the
+// form '<param>=<lo>:<hi>[:<step>]' or '<param>=<v1>,<v2>,...' where
+// <param> is a name in bpParams
+//
+// Returns True if Successful
+//
+int sweep_add(const char *spec);
+
+// Number of parameters given to sweep_add()
+//
+int sweep_size();
+
+// Decode at most 'max' records (0 for all) of 'trace' into memory and
+// evaluate each predictor type in 'types' at every combination of the
+// swept parameters it uses, on 'threads' threads. Parameters that
+// aren't swept keep the value of their global. Writes one CSV row per
+// configuration to 'out'.
+//
+// Returns True if Successful
+//
+int sweep_run(TraceReader *trace, uint64_t max, const int *types, int numTypes, int threads,
+              FILE *out);
+
+#endif
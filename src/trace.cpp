@@ -0,0 +1,432 @@
+//========================================================//
+//  trace.cpp                                             //
+//  Source file for the branch trace reader               //
+//                                                        //
+//  Hand-rolled parser for the text trace format. Works   //
+//  directly over large read buffers and never allocates  //
+//  per record.                                           //
+//========================================================//
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <thread>
+#include "trace.h"
+
+// Size of the buffer used to read stdio streams
+#define READ_CHUNK (1 << 20)
+
+// Size of the windows a mapped file is handed out in
+#define MAP_WINDOW (32 << 20)
+
+//------------------------------------//
+//            Byte Sources            //
+//------------------------------------//
+
+FileSource::FileSource(FILE *fp, int owned) : fp(fp), owned(owned)
+{
+  buf = (char *)malloc(READ_CHUNK);
+}
+
+FileSource::~FileSource()
+{
+  free(buf);
+  if (owned)
+    fclose(fp);
+}
+
+size_t FileSource::next(const char **data)
+{
+  *data = buf;
+  return fread(buf, 1, READ_CHUNK, fp);
+}
+
+MmapSource::MmapSource(const char *map, size_t size, size_t start)
+    : map(map), size(size), pos(start)
+{
+  // Windows stay aligned to MAP_WINDOW; the first one may be partial
+  size_t base = start - start % MAP_WINDOW;
+  madvise((void *)map, size, MADV_SEQUENTIAL);
+  if (base < size)
+    madvise((void *)(map + base), size - base < MAP_WINDOW ? size - base : MAP_WINDOW, MADV_WILLNEED);
+}
+
+MmapSource::~MmapSource()
+{
+  munmap((void *)map, size);
+}
+
+size_t MmapSource::next(const char **data)
+{
+  // The previous window has been consumed; drop it from our address
+  // space (the pages stay in the page cache for the next run)
+  if (pos > 0 && pos < size && pos % MAP_WINDOW == 0)
+    madvise((void *)(map + pos - MAP_WINDOW), MAP_WINDOW, MADV_DONTNEED);
+
+  if (pos >= size)
+    return 0;
+  size_t n = pos - pos % MAP_WINDOW + MAP_WINDOW;
+  n = (n < size ? n : size) - pos;
+  *data = map + pos;
+  pos += n;
+
+  // Start reading the window after this one
+  if (pos < size)
+    madvise((void *)(map + pos), size - pos < MAP_WINDOW ? size - pos : MAP_WINDOW, MADV_WILLNEED);
+  return n;
+}
+
+ByteSource *mmap_source_open(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || lseek(fd, 0, SEEK_CUR) != 0)
+    return NULL;
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  return new MmapSource((const char *)map, st.st_size);
+}
+
+//------------------------------------//
+//          Text Line Parser          //
+//------------------------------------//
+
+// Value of each character as a hex digit, or -1. Built at compile time,
+// so that readers on several threads share it without a race.
+struct hex_table
+{
+  signed char v[256];
+
+  constexpr hex_table() : v()
+  {
+    for (int c = 0; c < 256; c++)
+      v[c] = -1;
+    for (int c = '0'; c <= '9'; c++)
+      v[c] = c - '0';
+    for (int c = 'a'; c <= 'f'; c++)
+      v[c] = c - 'a' + 10;
+    for (int c = 'A'; c <= 'F'; c++)
+      v[c] = c - 'A' + 10;
+  }
+};
+
+static constexpr hex_table hexval;
+
+static inline int is_space(char c)
+{
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Extract one unsigned field starting at *pp, following the rules
+// of std::num_get for 'unsigned int': leading whitespace, an optional
+// sign, an optional 0x prefix in base 16, then digits. Overflow and
+// missing digits are failures.
+//
+// Returns True if Successful
+//
+static inline int parse_field(const char **pp, const char *end, int base, uint32_t *out)
+{
+  const char *p = *pp;
+  while (p < end && is_space(*p))
+    p++;
+  if (p == end)
+    return 0;
+
+  int negative = (*p == '-');
+  if (negative || *p == '+')
+  {
+    if (++p == end)
+      return 0;
+  }
+
+  int found_zero = 0;
+  if (*p == '0')
+  {
+    found_zero = 1;
+    p++;
+    if (base == 16 && p < end && (*p == 'x' || *p == 'X'))
+    {
+      found_zero = 0;
+      p++;
+    }
+  }
+
+  uint64_t result = 0;
+  int digits = 0;
+  int overflow = 0;
+  for (; p < end; p++)
+  {
+    int d = hexval.v[(unsigned char)*p];
+    if (d < 0 || d >= base)
+      break;
+    result = result * base + d;
+    if (result > 0xFFFFFFFFull)
+    {
+      overflow = 1;
+      result = 0;
+    }
+    digits++;
+  }
+
+  *pp = p;
+  if ((!digits && !found_zero) || overflow)
+    return 0;
+  *out = negative ? (uint32_t)-(uint32_t)result : (uint32_t)result;
+  return 1;
+}
+
+int parse_branch_line(const char *p, const char *end, branch_t *br)
+{
+  return parse_field(&p, end, 16, &br->pc) &&
+         parse_field(&p, end, 16, &br->target) &&
+         parse_field(&p, end, 10, &br->outcome) &&
+         parse_field(&p, end, 10, &br->condition) &&
+         parse_field(&p, end, 10, &br->call) &&
+         parse_field(&p, end, 10, &br->ret) &&
+         parse_field(&p, end, 10, &br->direct);
+}
+
+//------------------------------------//
+//            Trace Readers           //
+//------------------------------------//
+
+size_t TraceReader::next_batch(branch_batch_t *b)
+{
+  size_t n = 0;
+  branch_t br;
+  while (n < BATCH_SIZE && next(&br))
+  {
+    int flags = pack_flags(&br);
+    if (flags < 0)
+    {
+      fprintf(stderr, "Branch with a flag outside 0/1 ends the trace\n");
+      break;
+    }
+    b->pc[n] = br.pc;
+    b->target[n] = br.target;
+    b->flags[n] = flags;
+    n++;
+  }
+  b->count = n;
+  return n;
+}
+
+uint64_t TraceReader::skip(uint64_t n)
+{
+  branch_t br;
+  uint64_t i = 0;
+  while (i < n && next(&br))
+    i++;
+  return i;
+}
+
+//------------------------------------//
+//         Text Trace Reader          //
+//------------------------------------//
+
+TextTraceReader::TextTraceReader(ByteSource *src)
+    : src(src), cur(NULL), end(NULL), carry(NULL), carryLen(0), carryCap(0), done(0), failed(0)
+{
+  scan = text_scanner();
+}
+
+TextTraceReader::~TextTraceReader()
+{
+  free(carry);
+  delete src;
+}
+
+void TextTraceReader::append_carry(const char *p, size_t n)
+{
+  if (carryLen + n > carryCap)
+  {
+    carryCap = (carryLen + n) * 2;
+    carry = (char *)realloc(carry, carryCap);
+  }
+  memcpy(carry + carryLen, p, n);
+  carryLen += n;
+}
+
+int TextTraceReader::next(branch_t *br)
+{
+  if (failed)
+    return 0;
+
+  // Fast path: the whole line sits inside the current chunk
+  const char *nl = cur ? (const char *)memchr(cur, '\n', end - cur) : NULL;
+  if (nl)
+  {
+    const char *line = cur;
+    cur = nl + 1;
+    failed = !parse_branch_line(line, nl, br);
+    return !failed;
+  }
+
+  // Slow path: stitch the line together across chunk boundaries
+  carryLen = 0;
+  if (cur)
+    append_carry(cur, end - cur);
+  cur = end = NULL;
+  while (!done)
+  {
+    const char *data;
+    size_t n = src->next(&data);
+    if (n == 0)
+    {
+      done = 1;
+      break;
+    }
+    nl = (const char *)memchr(data, '\n', n);
+    if (nl)
+    {
+      append_carry(data, nl - data);
+      cur = nl + 1;
+      end = data + n;
+      failed = !parse_branch_line(carry, carry + carryLen, br);
+      return !failed;
+    }
+    append_carry(data, n);
+  }
+
+  // A final line without a trailing newline still counts
+  if (carryLen == 0)
+    return 0;
+  size_t n = carryLen;
+  carryLen = 0;
+  failed = !parse_branch_line(carry, carry + n, br);
+  return !failed;
+}
+
+size_t TextTraceReader::next_batch(branch_batch_t *b)
+{
+  size_t n = 0;
+  branch_t br;
+  while (n < BATCH_SIZE)
+  {
+    // Vector path over the current chunk, then one line the slow way:
+    // one it stopped at, or one that straddles chunks
+    if (scan && cur && !failed)
+      n = scan(&cur, end, b, n);
+    if (n == BATCH_SIZE || !next(&br))
+      break;
+
+    int flags = pack_flags(&br);
+    if (flags < 0)
+    {
+      fprintf(stderr, "Branch with a flag outside 0/1 ends the trace\n");
+      failed = 1;
+      break;
+    }
+    b->pc[n] = br.pc;
+    b->target[n] = br.target;
+    b->flags[n] = flags;
+    n++;
+  }
+  b->count = n;
+  return n;
+}
+
+// Hands out a chunk that was already taken from 'inner' for
+// sniffing, then the rest of 'inner'
+class ReplaySource : public ByteSource
+{
+public:
+  ReplaySource(ByteSource *inner, const char *first, size_t firstLen)
+      : inner(inner), first(first), firstLen(firstLen)
+  {
+  }
+  ~ReplaySource() { delete inner; }
+
+  size_t next(const char **data)
+  {
+    if (first)
+    {
+      *data = first;
+      first = NULL;
+      return firstLen;
+    }
+    return inner->next(data);
+  }
+
+private:
+  ByteSource *inner;
+  const char *first;
+  size_t firstLen;
+};
+
+// Pick the reader for a stream of trace bytes by its first chunk
+//
+static TraceReader *open_stream(ByteSource *src)
+{
+  const char *data;
+  size_t n = src->next(&data);
+  ByteSource *replay = new ReplaySource(src, n ? data : NULL, n);
+
+  if (is_ctrace((const uint8_t *)data, n))
+  {
+    CompactTraceReader *reader = new CompactTraceReader(replay);
+    if (!reader->valid())
+    {
+      delete reader;
+      return NULL;
+    }
+    return reader;
+  }
+  return new TextTraceReader(replay);
+}
+
+TraceReader *trace_open(FILE *fp)
+{
+  // A trace redirected from a file can be mapped like a named one
+  ByteSource *src = mmap_source_open(fileno(fp));
+  return open_stream(src ? src : new FileSource(fp));
+}
+
+TraceReader *trace_open_file(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  uint8_t magic[sizeof(btrace_header_t)];
+  ssize_t n = pread(fd, magic, sizeof(magic), 0);
+  if (n > 0 && is_btrace(magic, n) && fstat(fd, &st) == 0)
+  {
+    TraceReader *reader = btrace_open(fd, st.st_size);
+    close(fd);
+    return reader;
+  }
+
+  ByteSource *src = NULL;
+  int format = n > 0 ? frame_format(magic, n) : 0;
+  if (n > 0 && is_bz2(magic, n))
+  {
+    src = bz2_source_open(fd, std::thread::hardware_concurrency());
+    close(fd);
+  }
+  else if (format)
+  {
+    if (frame_native(format))
+      src = frame_source_open(fd, format, std::thread::hardware_concurrency());
+    else
+      src = frame_command_open(fd, format);
+    close(fd);
+  }
+  else if ((src = mmap_source_open(fd)) != NULL)
+  {
+    close(fd);
+  }
+  else
+  {
+    FILE *fp = fdopen(fd, "r");
+    if (fp)
+      src = new FileSource(fp, 1);
+    else
+      close(fd);
+  }
+
+  return src ? open_stream(src) : NULL;
+}
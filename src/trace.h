@@ -0,0 +1,579 @@
+//========================================================//
+//  trace.h                                               //
+//  Header file for the branch trace reader               //
+//                                                        //
+//  Turns a stream of trace bytes into branch records     //
+//  without allocating per record                         //
+//========================================================//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "branch.h"
+
+class TraceReader;
+
+// Static information about a trace, as written to <trace>.txt
+typedef struct
+{
+  uint64_t instructions;
+  uint64_t uncond;
+  uint64_t cond;
+  uint64_t call;
+  uint64_t ret;
+} trace_meta_t;
+
+//------------------------------------//
+//        Binary Trace Format         //
+//------------------------------------//
+
+// A binary trace is a btrace_header_t followed by 'num_records'
+// fixed-size btrace_rec_t records. All fields are little-endian.
+#define BTRACE_MAGIC "BPTRBIN"
+#define BTRACE_VERSION 1
+
+typedef struct
+{
+  char magic[8];        // BTRACE_MAGIC, NUL terminated
+  uint32_t version;     // BTRACE_VERSION
+  uint32_t header_size; // sizeof(btrace_header_t)
+  uint32_t record_size; // sizeof(btrace_rec_t)
+  uint32_t reserved;
+  uint64_t num_records;
+  trace_meta_t meta;    // zero if the .txt file was not available
+} btrace_header_t;
+
+typedef struct
+{
+  uint32_t pc;
+  uint32_t target;
+  uint8_t flags; // BR_* bits
+  uint8_t pad[3];
+} btrace_rec_t;
+
+// Read the <trace>.txt file at 'path' into 'meta'
+//
+// Returns True if Successful
+//
+int trace_read_meta(const char *path, trace_meta_t *meta);
+
+// Guess the metadata file of a trace: 'traces/lbm.bz2' -> 'traces/lbm.txt'.
+// Returns True and fills 'meta' if the file exists and parses.
+//
+int trace_find_meta(const char *trace_path, trace_meta_t *meta);
+
+// Metadata of the trace file at 'path': from its header if it is a
+// binary or compact trace that has it, otherwise from <trace>.txt as
+// trace_find_meta(). Returns True and fills 'meta' if either is found.
+//
+int trace_file_meta(const char *path, trace_meta_t *meta);
+
+// Writes a binary trace one record or batch at a time
+class BinaryTraceWriter
+{
+public:
+  BinaryTraceWriter(FILE *out, const trace_meta_t *meta);
+
+  // Returns True if Successful
+  int add(uint32_t pc, uint32_t target, uint8_t flags);
+  int add_batch(const branch_batch_t *b);
+
+  // Flush and fill in the record count; the caller closes 'out'.
+  // Returns the number of records written, or -1 on failure
+  int64_t finish();
+
+private:
+  FILE *out;
+  btrace_header_t hdr;
+  btrace_rec_t buf[BATCH_SIZE];
+  size_t fill;
+  int failed;
+
+  int flush();
+};
+
+// Write the branches of 'in' to 'out' as a binary trace
+//
+// Returns the number of records written, or -1 on failure
+//
+int64_t btrace_write(TraceReader *in, FILE *out, const trace_meta_t *meta);
+
+//------------------------------------//
+//        Compact Trace Format        //
+//------------------------------------//
+
+// A compact trace stores each static branch once and the dynamic
+// stream as columns:
+//
+//   ctrace_header_t
+//   num_static dictionary entries (btrace_rec_t)
+//   token_bytes of range-coded varint tokens
+//   outcome_bytes of range-coded outcomes
+//
+// Conditional entries have BR_TAKEN clear and take their outcome from
+// the next bit of the outcome stream; other entries carry their
+// outcome in the dictionary.
+//
+// Each branch remembers the branch that followed it last time, per
+// outcome. A token v with (v & 1) names the next branch explicitly as
+// entry v >> 1 and makes it the remembered successor; a token with
+// !(v & 1) says the next v >> 1 branches each follow their remembered
+// successor.
+//
+// Both streams are coded with an adaptive binary range coder. The bits
+// of each varint byte are modelled by the previous token, and each
+// outcome by its branch and the global outcomes before it (see
+// trace_compact.cpp).
+#define CTRACE_MAGIC "BPTRCMP"
+#define CTRACE_VERSION 2
+
+typedef struct
+{
+  char magic[8];        // CTRACE_MAGIC, NUL terminated
+  uint32_t version;     // CTRACE_VERSION
+  uint32_t header_size; // sizeof(ctrace_header_t)
+  uint64_t num_records;
+  uint32_t num_static;
+  uint32_t reserved;
+  uint64_t token_bytes;
+  uint64_t outcome_bits; // number of conditional branches
+  uint64_t outcome_bytes;
+  trace_meta_t meta;    // zero if the .txt file was not available
+} ctrace_header_t;
+
+// Write the branches of 'in' to 'out' as a compact trace
+//
+// Returns the number of records written, or -1 on failure
+//
+int64_t ctrace_write(TraceReader *in, FILE *out, const trace_meta_t *meta);
+
+//------------------------------------//
+//            Byte Sources            //
+//------------------------------------//
+
+// Supplies the (decompressed) bytes of a trace in contiguous chunks.
+// A chunk stays valid until the next call to next().
+class ByteSource
+{
+public:
+  virtual ~ByteSource() {}
+
+  // Point *data at the next chunk and return its length.
+  // Returns 0 once the stream is exhausted.
+  virtual size_t next(const char **data) = 0;
+};
+
+// Reads a stdio stream through one large buffer.
+// Closes the stream on destruction if 'owned' is set.
+class FileSource : public ByteSource
+{
+public:
+  FileSource(FILE *fp, int owned = 0);
+  ~FileSource();
+  size_t next(const char **data);
+
+private:
+  FILE *fp;
+  int owned;
+  char *buf;
+};
+
+// Hands out a memory-mapped file from byte 'start' on, in windows that
+// point straight into the mapping, so the parser reads the page cache
+// with no copies. Upcoming windows are prefetched, and consumed ones are
+// released with MADV_DONTNEED: their pages leave this process but stay
+// in the page cache, and the mapping itself lasts until destruction.
+class MmapSource : public ByteSource
+{
+public:
+  MmapSource(const char *map, size_t size, size_t start = 0);
+  ~MmapSource();
+  size_t next(const char **data);
+
+private:
+  const char *map;
+  size_t size;
+  size_t pos;
+};
+
+// Map the regular file open on 'fd', which must be positioned at its
+// start. Returns NULL if it can't be mapped; 'fd' may be closed afterwards.
+//
+ByteSource *mmap_source_open(int fd);
+
+//------------------------------------//
+//        Compressed Byte Sources     //
+//------------------------------------//
+
+// Extent of one independently compressed block inside a file: bit
+// offsets for a bzip2 block (from its block magic up to the next block
+// or end-of-stream magic), byte offsets for a zstd or lz4 frame
+typedef struct
+{
+  uint64_t start;
+  uint64_t end;
+} block_span_t;
+
+// Decompresses the blocks of a memory-mapped file on worker threads,
+// running a few blocks ahead of the consumer, and hands out one chunk
+// per block in stream order. Subclasses supply decode(), call start()
+// at the end of their constructor and finish() at the start of their
+// destructor.
+class BlockSource : public ByteSource
+{
+public:
+  BlockSource(const uint8_t *data, size_t size, const std::vector<block_span_t> &blocks,
+              uint64_t skip);
+  virtual ~BlockSource();
+
+  // Chunks have the first 'skip' decompressed bytes removed
+  size_t next(const char **data);
+
+  // Compressed extent of the chunk returned last
+  const block_span_t &span() const { return last; }
+
+  // Returns True if decoding stopped at a corrupt block
+  int failed() const { return corrupt; }
+
+protected:
+  const uint8_t *data;
+  size_t size;
+  std::vector<block_span_t> blocks;
+  int joinFailed; // retry a failed block joined with its successors
+
+  // Decompress the compressed bytes or bits from 'start' to 'end'
+  // into 'out', which may hold a recycled buffer to grow or reuse
+  //
+  // Returns True if Successful
+  //
+  virtual int decode(uint64_t start, uint64_t end, std::vector<char> &out) = 0;
+
+  void start(int threads);
+  void finish();
+
+private:
+  struct Slot
+  {
+    std::vector<char> out;
+    int ready;
+    int ok;
+  };
+
+  std::vector<Slot> slots;
+  std::vector<std::vector<char> > spare; // released buffers for reuse
+  size_t window;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::vector<std::thread> workers;
+  size_t claimed;  // next block a worker will pick up
+  size_t consumed; // next block handed to the parser
+  int stop;
+  int corrupt;
+  uint64_t skip;   // decompressed bytes still to drop
+  block_span_t last;
+
+  void worker();
+  void recycle(std::vector<char> &out);
+};
+
+// Returns True if the bytes start with a bzip2 stream header
+//
+int is_bz2(const uint8_t *p, size_t size);
+
+// Locate every compressed block of a (possibly multi-stream) bzip2 file
+//
+void bz2_find_blocks(const uint8_t *p, size_t size, std::vector<block_span_t> &blocks);
+
+// Decode the bzip2 file open on 'fd', decompressing its blocks on
+// 'threads' worker threads. Only 'blocks' are decoded if given (as
+// previously found by bz2_find_blocks() or a trace index), and the
+// first 'skip' decompressed bytes are dropped. The file is mapped;
+// 'fd' may be closed afterwards. Returns NULL on failure.
+//
+BlockSource *bz2_source_open(int fd, int threads, const std::vector<block_span_t> *blocks = NULL,
+                             uint64_t skip = 0);
+
+#define FRAME_ZSTD 1
+#define FRAME_LZ4 2
+
+// Returns FRAME_ZSTD or FRAME_LZ4 if the bytes start with a zstd or
+// lz4 frame, else 0
+//
+int frame_format(const uint8_t *p, size_t size);
+
+// Returns True if this build decodes 'format' in-process (see the
+// ZSTD and LZ4 options of the Makefile)
+//
+int frame_native(int format);
+
+// Locate every frame of a zstd or lz4 file. Skippable frames are left out.
+//
+// Returns True if Successful
+//
+int frame_find(int format, const uint8_t *p, size_t size, std::vector<block_span_t> &frames);
+
+// As bz2_source_open(), for a file of zstd or lz4 frames which are
+// decoded one frame per block. Returns NULL on failure or if
+// !frame_native(format).
+//
+BlockSource *frame_source_open(int fd, int format, int threads,
+                               const std::vector<block_span_t> *frames = NULL, uint64_t skip = 0);
+
+// Decode the zstd or lz4 file open on 'fd' by piping it through the
+// zstd or lz4 command. 'fd' may be closed afterwards. Returns NULL if
+// the command can't be started.
+//
+ByteSource *frame_command_open(int fd, int format);
+
+//------------------------------------//
+//            Trace Readers           //
+//------------------------------------//
+
+// Produces branch records one at a time or in batches
+class TraceReader
+{
+public:
+  virtual ~TraceReader() {}
+
+  // Fill in 'br' with the next branch of the trace.
+  // Returns True if Successful
+  virtual int next(branch_t *br) = 0;
+
+  // Fill 'b' with up to BATCH_SIZE following branches and return how
+  // many were read; 0 at the end of the trace. A branch whose fields
+  // can't be packed into BR_* bits ends the trace.
+  virtual size_t next_batch(branch_batch_t *b);
+
+  // Discard the next 'n' branches and return how many were discarded,
+  // which is less than 'n' at the end of the trace
+  virtual uint64_t skip(uint64_t n);
+};
+
+// Parse lines of the text trace from *pp into b->pc/target/flags[n...]
+// until the batch is full or a line would have to be checked by
+// parse_branch_line(): one that isn't in the canonical form written by
+// branchExtractor, or that may not end before 'end'. Advances *pp past
+// the lines parsed and returns the new count.
+typedef size_t (*text_scan_fn)(const char **pp, const char *end, branch_batch_t *b, size_t n);
+
+// The vectorized line scanner for this CPU (AVX-512 or AVX2), or NULL.
+// BP_TRACE_SCAN=avx2 or BP_TRACE_SCAN=scalar in the environment caps
+// the instruction set used.
+//
+text_scan_fn text_scanner();
+
+// Parses the tab/newline delimited text trace in place over the
+// chunks of a ByteSource. Produces the same values as extracting
+// each line with 'std::hex >> pc >> target >> std::dec >> ...' and
+// ends the trace at the first line that extraction would reject.
+// Batches are read with text_scanner() where the CPU supports it.
+class TextTraceReader : public TraceReader
+{
+public:
+  TextTraceReader(ByteSource *src);
+  ~TextTraceReader();
+  int next(branch_t *br);
+  size_t next_batch(branch_batch_t *b);
+
+private:
+  ByteSource *src;
+  const char *cur;
+  const char *end;
+  char *carry;      // holds a line that straddles two chunks
+  size_t carryLen;
+  size_t carryCap;
+  int done;
+  int failed;       // a line was rejected
+  text_scan_fn scan;
+
+  void append_carry(const char *p, size_t n);
+};
+
+// Parse one line (without its newline) of the text trace
+//
+// Returns True if Successful
+//
+int parse_branch_line(const char *p, const char *end, branch_t *br);
+
+// Iterates the records of a memory-mapped binary trace
+class BinaryTraceReader : public TraceReader
+{
+public:
+  BinaryTraceReader(const uint8_t *map, size_t size);
+  ~BinaryTraceReader();
+  int next(branch_t *br);
+  size_t next_batch(branch_batch_t *b);
+  uint64_t skip(uint64_t n);
+
+  const btrace_header_t *header() const { return hdr; }
+
+private:
+  const uint8_t *map;
+  size_t size;
+  const btrace_header_t *hdr;
+  const btrace_rec_t *cur;
+  const btrace_rec_t *end;
+};
+
+// Returns True if the bytes start with a binary trace header
+//
+int is_btrace(const uint8_t *p, size_t size);
+
+// Map the binary trace open on 'fd' and check its header. 'fd' may be
+// closed afterwards. Returns NULL if this build can't read the file.
+//
+TraceReader *btrace_open(int fd, size_t size);
+
+struct CompactModel;
+
+// Decodes a compact trace in one streaming pass over a ByteSource.
+// The header, dictionary and tokens are small and read up front; the
+// outcome stream is decoded chunk by chunk as branches are returned.
+class CompactTraceReader : public TraceReader
+{
+public:
+  CompactTraceReader(ByteSource *src);
+  ~CompactTraceReader();
+  int next(branch_t *br);
+
+  // Returns True if the header was read and this build understands it
+  int valid() const { return ok; }
+  const ctrace_header_t *header() const { return &hdr; }
+
+private:
+  ByteSource *src;
+  const char *cur;   // unread bytes of the current chunk
+  const char *end;
+  ctrace_header_t hdr;
+  btrace_rec_t *dict;
+  uint8_t *tokens;
+  const uint8_t *tok;
+  const uint8_t *tokEnd;
+  CompactModel *model; // contexts and range decoders of both streams
+  uint64_t bitsLeft;
+  uint64_t outcomeLeft; // outcome stream bytes not yet read
+  uint64_t left;     // records not yet returned
+  uint64_t run;      // records left in the current successor run
+  uint32_t *succ;    // remembered successor per entry and outcome
+  int64_t prevCtx;   // succ slot of the previous branch, or -1
+  int truncated;     // the outcome stream ended early
+  int ok;
+
+  int read_exact(void *dst, size_t n);
+  void *read_alloc(uint64_t n);
+  int token(uint64_t *v);
+  uint8_t token_byte();
+  uint8_t outcome_byte();
+};
+
+// Returns True if the bytes start with a compact trace header
+//
+int is_ctrace(const uint8_t *p, size_t size);
+
+//------------------------------------//
+//            Trace Cache             //
+//------------------------------------//
+
+// 64-bit hash of the size and contents of the file at 'path';
+// 0 if it can't be read
+//
+uint64_t trace_file_hash(const char *path);
+
+// Open the trace at 'path' through the cache in 'cache_dir', keyed by
+// trace_file_hash(). On a hit the decoded binary copy is mapped; on a
+// miss the trace is decoded as usual and a binary copy is written to
+// the cache as the records go by. Binary and compact traces are
+// opened directly. Returns NULL if the trace can't be opened.
+//
+TraceReader *trace_open_cached(const char *path, const char *cache_dir);
+
+//------------------------------------//
+//            Trace Index             //
+//------------------------------------//
+
+// A trace index is a sidecar file '<trace>.idx' of checkpoints that
+// let a reader start decoding close to any branch of a text trace,
+// plain or compressed. It is a tindex_header_t followed by
+// 'num_entries' tindex_entry_t sorted by record.
+//
+// For a compressed trace there is one entry per bzip2 block or
+// zstd/lz4 frame, and the blocks of all entries together make up the
+// whole stream. For a plain text trace there is one entry every
+// TINDEX_INTERVAL records.
+#define TINDEX_MAGIC "BPTRIDX"
+#define TINDEX_VERSION 1
+#define TINDEX_INTERVAL (1 << 20)
+
+#define TINDEX_TEXT 1
+#define TINDEX_BZ2 2
+#define TINDEX_ZSTD 3
+#define TINDEX_LZ4 4
+
+typedef struct
+{
+  char magic[8];         // TINDEX_MAGIC, NUL terminated
+  uint32_t version;      // TINDEX_VERSION
+  uint32_t kind;         // TINDEX_TEXT, TINDEX_BZ2, ...
+  uint64_t source_size;  // size and modification time (ns) of the
+  uint64_t source_mtime; // trace, to notice a stale index
+  uint64_t num_records;
+  uint64_t num_entries;
+} tindex_header_t;
+
+typedef struct
+{
+  uint64_t start;  // compressed: block_span_t of the block; text: byte
+  uint64_t end;    // offset of 'record' and unused
+  uint64_t record; // first record that starts inside the block
+  uint64_t skip;   // compressed: decompressed bytes of the block before
+                   // 'record', or TINDEX_NO_RECORD if no record starts in it
+} tindex_entry_t;
+
+#define TINDEX_NO_RECORD UINT64_MAX
+
+// Write the index of the text trace at 'path', plain or compressed, to 'idx_path'
+//
+// Returns the number of entries written, or -1 on failure
+//
+int64_t trace_index_build(const char *path, const char *idx_path);
+
+// Open the trace file at 'path' positioned at branch 'first' (counting
+// from 0). Uses '<path>.idx' when it matches the trace, so that only
+// one block or interval is decoded before 'first'; binary traces are
+// positioned directly, anything else by reading up to 'first'.
+// Returns NULL if the trace can't be opened.
+//
+TraceReader *trace_open_at(const char *path, uint64_t first);
+
+//------------------------------------//
+//         Pipelined Reading          //
+//------------------------------------//
+
+// Number of batches in flight between the reader thread and the consumer
+#define PIPE_DEPTH 16
+
+// Wrap 'inner' so that it is decoded on a separate thread. Records are
+// passed to the caller in batches through a single-producer,
+// single-consumer lock-free ring and come out in the original order.
+//
+TraceReader *trace_pipeline(TraceReader *inner);
+
+// Open a text trace read from 'fp'
+//
+TraceReader *trace_open(FILE *fp);
+
+// Open the trace file at 'path', which may be a binary or compact
+// trace, plain text, or text compressed with bzip2, zstd or lz4.
+// Returns NULL if it can't be opened.
+//
+TraceReader *trace_open_file(const char *path);
+
+#endif
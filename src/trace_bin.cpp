@@ -0,0 +1,237 @@
+//========================================================//
+//  trace_bin.cpp                                         //
+//  Binary trace format: metadata, writer and             //
+//  memory-mapped reader                                  //
+//========================================================//
+#include <string.h>
+#include <sys/mman.h>
+#include "trace.h"
+
+//------------------------------------//
+//             Metadata               //
+//------------------------------------//
+
+int trace_read_meta(const char *path, trace_meta_t *meta)
+{
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return 0;
+
+  memset(meta, 0, sizeof(*meta));
+  char line[256];
+  int found = 0;
+  while (fgets(line, sizeof(line), fp))
+  {
+    unsigned long long v;
+    if (sscanf(line, "!!! Number of Instructions = %llu", &v) == 1)
+      meta->instructions = v, found++;
+    else if (sscanf(line, "!!! Number of Unconditional branches = %llu", &v) == 1)
+      meta->uncond = v, found++;
+    else if (sscanf(line, "!!! Number of Conditional branches = %llu", &v) == 1)
+      meta->cond = v, found++;
+    else if (sscanf(line, "!!! Number of Call branches = %llu", &v) == 1)
+      meta->call = v, found++;
+    else if (sscanf(line, "!!! Number of Ret branches = %llu", &v) == 1)
+      meta->ret = v, found++;
+  }
+  fclose(fp);
+  return found > 0;
+}
+
+int trace_find_meta(const char *trace_path, trace_meta_t *meta)
+{
+  size_t n = strlen(trace_path);
+  char *path = (char *)malloc(n + 5);
+  strcpy(path, trace_path);
+
+  // Replace the extension of the file name, if any
+  char *slash = strrchr(path, '/');
+  char *dot = strrchr(path, '.');
+  if (dot && (!slash || dot > slash))
+    *dot = '\0';
+  strcat(path, ".txt");
+
+  int ok = strcmp(path, trace_path) != 0 && trace_read_meta(path, meta);
+  free(path);
+  return ok;
+}
+
+int trace_file_meta(const char *path, trace_meta_t *meta)
+{
+  // Big enough for either header
+  uint8_t hdr[sizeof(btrace_header_t) + sizeof(ctrace_header_t)];
+  size_t n = 0;
+  FILE *fp = fopen(path, "rb");
+  if (fp)
+  {
+    n = fread(hdr, 1, sizeof(hdr), fp);
+    fclose(fp);
+  }
+  if (is_btrace(hdr, n))
+    *meta = ((const btrace_header_t *)hdr)->meta;
+  else if (is_ctrace(hdr, n))
+    *meta = ((const ctrace_header_t *)hdr)->meta;
+  else
+    return trace_find_meta(path, meta);
+  return meta->instructions != 0 || trace_find_meta(path, meta);
+}
+
+//------------------------------------//
+//              Writer                //
+//------------------------------------//
+
+BinaryTraceWriter::BinaryTraceWriter(FILE *out, const trace_meta_t *meta)
+    : out(out), fill(0), failed(0)
+{
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, BTRACE_MAGIC, sizeof(BTRACE_MAGIC));
+  hdr.version = BTRACE_VERSION;
+  hdr.header_size = sizeof(btrace_header_t);
+  hdr.record_size = sizeof(btrace_rec_t);
+  if (meta)
+    hdr.meta = *meta;
+  memset(buf, 0, sizeof(buf));
+
+  // Placeholder header; the record count is filled in by finish()
+  if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+    failed = 1;
+}
+
+int BinaryTraceWriter::flush()
+{
+  if (fill && fwrite(buf, sizeof(btrace_rec_t), fill, out) != fill)
+    failed = 1;
+  fill = 0;
+  return !failed;
+}
+
+int BinaryTraceWriter::add(uint32_t pc, uint32_t target, uint8_t flags)
+{
+  buf[fill].pc = pc;
+  buf[fill].target = target;
+  buf[fill].flags = flags;
+  hdr.num_records++;
+  if (++fill == BATCH_SIZE)
+    return flush();
+  return !failed;
+}
+
+int BinaryTraceWriter::add_batch(const branch_batch_t *b)
+{
+  for (size_t i = 0; i < b->count; i++)
+  {
+    if (!add(b->pc[i], b->target[i], b->flags[i]))
+      return 0;
+  }
+  return 1;
+}
+
+int64_t BinaryTraceWriter::finish()
+{
+  if (!flush() || fseek(out, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+      fflush(out) != 0)
+    return -1;
+  return hdr.num_records;
+}
+
+int64_t btrace_write(TraceReader *in, FILE *out, const trace_meta_t *meta)
+{
+  BinaryTraceWriter *w = new BinaryTraceWriter(out, meta);
+  branch_t br;
+  int ok = 1;
+  while (ok && in->next(&br))
+  {
+    int flags = pack_flags(&br);
+    if (flags < 0)
+    {
+      fprintf(stderr, "Branch has a flag outside 0/1\n");
+      ok = 0;
+      break;
+    }
+    ok = w->add(br.pc, br.target, flags);
+  }
+
+  int64_t n = ok ? w->finish() : -1;
+  delete w;
+  return n;
+}
+
+//------------------------------------//
+//              Reader                //
+//------------------------------------//
+
+int is_btrace(const uint8_t *p, size_t size)
+{
+  if (size < sizeof(btrace_header_t))
+    return 0;
+  const btrace_header_t *hdr = (const btrace_header_t *)p;
+  return memcmp(hdr->magic, BTRACE_MAGIC, sizeof(BTRACE_MAGIC)) == 0;
+}
+
+BinaryTraceReader::BinaryTraceReader(const uint8_t *map, size_t size)
+    : map(map), size(size)
+{
+  hdr = (const btrace_header_t *)map;
+  cur = (const btrace_rec_t *)(map + hdr->header_size);
+  end = cur + hdr->num_records;
+}
+
+BinaryTraceReader::~BinaryTraceReader()
+{
+  munmap((void *)map, size);
+}
+
+int BinaryTraceReader::next(branch_t *br)
+{
+  if (cur == end)
+    return 0;
+  br->pc = cur->pc;
+  br->target = cur->target;
+  unpack_flags(cur->flags, br);
+  cur++;
+  return 1;
+}
+
+size_t BinaryTraceReader::next_batch(branch_batch_t *b)
+{
+  size_t n = end - cur < BATCH_SIZE ? end - cur : BATCH_SIZE;
+  for (size_t i = 0; i < n; i++)
+  {
+    b->pc[i] = cur[i].pc;
+    b->target[i] = cur[i].target;
+    b->flags[i] = cur[i].flags;
+  }
+  cur += n;
+  b->count = n;
+  return n;
+}
+
+uint64_t BinaryTraceReader::skip(uint64_t n)
+{
+  if (n > (uint64_t)(end - cur))
+    n = end - cur;
+  cur += n;
+  return n;
+}
+
+TraceReader *btrace_open(int fd, size_t size)
+{
+  if (size < sizeof(btrace_header_t))
+    return NULL;
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  const btrace_header_t *hdr = (const btrace_header_t *)map;
+  if (hdr->version != BTRACE_VERSION || hdr->record_size != sizeof(btrace_rec_t) ||
+      hdr->header_size < sizeof(btrace_header_t) || hdr->header_size > size ||
+      hdr->num_records > (size - hdr->header_size) / sizeof(btrace_rec_t))
+  {
+    fprintf(stderr, "Unsupported or truncated binary trace (version %u)\n", hdr->version);
+    munmap(map, size);
+    return NULL;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+  madvise(map, size, MADV_WILLNEED);
+  return new BinaryTraceReader((const uint8_t *)map, size);
+}
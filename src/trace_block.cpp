@@ -0,0 +1,162 @@
+//========================================================//
+//  trace_block.cpp                                       //
+//  Parallel decoding of independently compressed blocks  //
+//                                                        //
+//  Worker threads decompress the blocks of a bzip2, zstd //
+//  or lz4 trace ahead of the parser, which receives them //
+//  in stream order.                                      //
+//========================================================//
+#include <string.h>
+#include <sys/mman.h>
+#include "trace.h"
+
+// Number of blocks a worker may run ahead of the consumer, per thread
+#define BLOCK_WINDOW_PER_THREAD 2
+
+BlockSource::BlockSource(const uint8_t *data, size_t size, const std::vector<block_span_t> &blocks,
+                         uint64_t skip)
+    : data(data), size(size), blocks(blocks), joinFailed(0), claimed(0), consumed(0), stop(0),
+      corrupt(0), skip(skip)
+{
+  slots.resize(blocks.size());
+  for (size_t i = 0; i < slots.size(); i++)
+  {
+    slots[i].ready = 0;
+    slots[i].ok = 0;
+  }
+  last.start = last.end = 0;
+}
+
+BlockSource::~BlockSource()
+{
+  munmap((void *)data, size);
+}
+
+void BlockSource::start(int threads)
+{
+  if (threads < 1)
+    threads = 1;
+  window = (size_t)threads * BLOCK_WINDOW_PER_THREAD;
+  for (int i = 0; i < threads; i++)
+    workers.push_back(std::thread(&BlockSource::worker, this));
+}
+
+void BlockSource::finish()
+{
+  {
+    std::lock_guard<std::mutex> g(lock);
+    stop = 1;
+  }
+  cv.notify_all();
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+  workers.clear();
+}
+
+void BlockSource::recycle(std::vector<char> &out)
+{
+  if (spare.size() < window)
+  {
+    spare.push_back(std::vector<char>());
+    spare.back().swap(out);
+  }
+  std::vector<char>().swap(out);
+}
+
+void BlockSource::worker()
+{
+  std::vector<char> out;
+  for (;;)
+  {
+    size_t i;
+    {
+      std::unique_lock<std::mutex> g(lock);
+      cv.wait(g, [this] { return stop || (claimed < blocks.size() && claimed < consumed + window); });
+      if (stop)
+        return;
+      i = claimed++;
+      if (!spare.empty())
+      {
+        out.swap(spare.back());
+        spare.pop_back();
+      }
+    }
+
+    int ok = decode(blocks[i].start, blocks[i].end, out);
+
+    {
+      std::lock_guard<std::mutex> g(lock);
+      slots[i].out.swap(out);
+      slots[i].ok = ok;
+      slots[i].ready = 1;
+    }
+    cv.notify_all();
+  }
+}
+
+size_t BlockSource::next(const char **data)
+{
+  std::unique_lock<std::mutex> g(lock);
+
+  // Release the chunk handed out last time
+  if (consumed > 0)
+    recycle(slots[consumed - 1].out);
+
+  while (consumed < blocks.size())
+  {
+    size_t i = consumed;
+    cv.wait(g, [this, i] { return slots[i].ready != 0; });
+
+    // A block boundary found by a scan may be bogus. If a block fails
+    // on its own, join it with its successors until it decodes and
+    // drop the successors' separate results.
+    size_t last = i;
+    if (!slots[i].ok)
+    {
+      g.unlock();
+      std::vector<char> out;
+      int ok = 0;
+      while (joinFailed && !ok && ++last < blocks.size())
+        ok = decode(blocks[i].start, blocks[last].end, out);
+      g.lock();
+      if (!ok)
+      {
+        fprintf(stderr, "Corrupt compressed block in trace\n");
+        corrupt = 1;
+        consumed = blocks.size();
+        cv.notify_all();
+        return 0;
+      }
+      slots[i].out.swap(out);
+      // Workers only claim blocks inside the window, so the successors
+      // not yet claimed are skipped rather than waited for
+      size_t claimedBefore = claimed;
+      if (claimed < last + 1)
+        claimed = last + 1;
+      for (size_t j = i + 1; j <= last && j < claimedBefore; j++)
+      {
+        cv.wait(g, [this, j] { return slots[j].ready != 0; });
+        recycle(slots[j].out);
+      }
+    }
+
+    consumed = last + 1;
+    cv.notify_all();
+
+    // Keep the slot of the returned block releasable on the next call
+    std::vector<char> &out = slots[consumed - 1].out;
+    if (i != consumed - 1)
+      out.swap(slots[i].out);
+    uint64_t drop = skip < out.size() ? skip : out.size();
+    skip -= drop;
+    if (drop < out.size())
+    {
+      this->last.start = blocks[i].start;
+      this->last.end = blocks[consumed - 1].end;
+      *data = &out[drop];
+      return out.size() - drop;
+    }
+    recycle(out);
+  }
+  return 0;
+}
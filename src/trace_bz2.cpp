@@ -0,0 +1,198 @@
+//========================================================//
+//  trace_bz2.cpp                                         //
+//  In-process bzip2 decoding of trace files              //
+//                                                        //
+//  The compressed stream is split at bzip2 block         //
+//  boundaries so that the blocks can be decompressed on  //
+//  worker threads.                                       //
+//========================================================//
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <bzlib.h>
+#include <vector>
+#include "trace.h"
+
+#define BZ_BLOCK_MAGIC 0x314159265359ull
+#define BZ_EOS_MAGIC 0x177245385090ull
+
+//------------------------------------//
+//         Block Boundary Scan        //
+//------------------------------------//
+
+// Read 'n' (<= 57) bits starting at bit offset 'pos', MSB first
+static inline uint64_t get_bits(const uint8_t *p, size_t size, uint64_t pos, int n)
+{
+  uint64_t v = 0;
+  size_t byte = pos >> 3;
+  for (int i = 0; i < 8; i++)
+    v = (v << 8) | (byte + i < size ? p[byte + i] : 0);
+  return (v << (pos & 7)) >> (64 - n);
+}
+
+void bz2_find_blocks(const uint8_t *p, size_t size, std::vector<block_span_t> &blocks)
+{
+  const uint64_t mask = (1ull << 48) - 1;
+  uint64_t window = 0;
+  uint64_t open = 0;
+  int in_block = 0;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    uint8_t byte = p[i];
+    for (int b = 7; b >= 0; b--)
+    {
+      window = ((window << 1) | ((byte >> b) & 1)) & mask;
+      if (window != BZ_BLOCK_MAGIC && window != BZ_EOS_MAGIC)
+        continue;
+
+      // Bit offset of the first bit of the magic
+      uint64_t pos = (uint64_t)i * 8 + (7 - b) - 47;
+      if (in_block)
+      {
+        block_span_t blk;
+        blk.start = open;
+        blk.end = pos;
+        blocks.push_back(blk);
+      }
+      in_block = (window == BZ_BLOCK_MAGIC);
+      open = pos;
+    }
+  }
+
+  // A truncated stream ends inside a block. Keep it, so that it fails
+  // to decode and the trace is reported corrupt rather than cut short.
+  if (in_block)
+  {
+    block_span_t blk;
+    blk.start = open;
+    blk.end = (uint64_t)size * 8;
+    blocks.push_back(blk);
+  }
+}
+
+// Wrap the bits of one block in a stream header and trailer so that
+// libbz2 can decode it on its own. A single-block stream's combined
+// CRC is just the block CRC stored after the block magic.
+static std::vector<uint8_t> standalone_block(const uint8_t *p, size_t size, uint64_t start, uint64_t end)
+{
+  uint64_t nbits = end - start;
+  std::vector<uint8_t> out(4 + (nbits + 80 + 7) / 8 + 1, 0);
+  memcpy(&out[0], "BZh9", 4);
+
+  size_t byte = start >> 3;
+  int shift = start & 7;
+  size_t nbytes = (nbits + 7) / 8;
+  for (size_t k = 0; k < nbytes; k++)
+  {
+    uint8_t hi = byte + k < size ? p[byte + k] : 0;
+    uint8_t lo = byte + k + 1 < size ? p[byte + k + 1] : 0;
+    out[4 + k] = shift ? (uint8_t)((hi << shift) | (lo >> (8 - shift))) : hi;
+  }
+  // Clear the bits past the end of the block
+  if (nbits & 7)
+    out[4 + nbits / 8] &= (uint8_t)(0xFF << (8 - (nbits & 7)));
+
+  uint64_t crc = get_bits(p, size, start + 48, 32);
+  uint64_t tail[2] = {BZ_EOS_MAGIC, crc};
+  int tail_len[2] = {48, 32};
+  uint64_t pos = 32 + nbits;
+  for (int t = 0; t < 2; t++)
+  {
+    for (int i = tail_len[t] - 1; i >= 0; i--, pos++)
+    {
+      if ((tail[t] >> i) & 1)
+        out[pos >> 3] |= (uint8_t)(0x80 >> (pos & 7));
+    }
+  }
+  out.resize((pos + 7) / 8);
+  return out;
+}
+
+// Decompress a standalone bzip2 stream into 'out'
+//
+// Returns True if Successful
+//
+static int decompress_all(std::vector<uint8_t> &in, std::vector<char> &out)
+{
+  bz_stream bz;
+  memset(&bz, 0, sizeof(bz));
+  if (BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK)
+    return 0;
+
+  out.resize(out.capacity() > (1 << 20) ? out.capacity() : 1 << 20);
+  bz.next_in = (char *)&in[0];
+  bz.avail_in = in.size();
+  size_t produced = 0;
+  int rc;
+  do
+  {
+    if (produced == out.size())
+      out.resize(out.size() * 2);
+    bz.next_out = &out[produced];
+    bz.avail_out = out.size() - produced;
+    rc = BZ2_bzDecompress(&bz);
+    produced = out.size() - bz.avail_out;
+  } while (rc == BZ_OK && (bz.avail_in > 0 || bz.avail_out == 0));
+
+  BZ2_bzDecompressEnd(&bz);
+  out.resize(produced);
+  return rc == BZ_STREAM_END;
+}
+
+//------------------------------------//
+//         Bzip2 Block Source         //
+//------------------------------------//
+
+class Bz2Source : public BlockSource
+{
+public:
+  Bz2Source(const uint8_t *data, size_t size, const std::vector<block_span_t> &blocks, int threads,
+            uint64_t skip)
+      : BlockSource(data, size, blocks, skip)
+  {
+    // A block magic can in principle occur inside compressed data
+    joinFailed = 1;
+    start(threads);
+  }
+  ~Bz2Source() { finish(); }
+
+protected:
+  int decode(uint64_t start, uint64_t end, std::vector<char> &out)
+  {
+    std::vector<uint8_t> in = standalone_block(data, size, start, end);
+    return decompress_all(in, out);
+  }
+};
+
+//------------------------------------//
+//             Interface              //
+//------------------------------------//
+
+int is_bz2(const uint8_t *p, size_t size)
+{
+  return size >= 4 && p[0] == 'B' && p[1] == 'Z' && p[2] == 'h' && p[3] >= '1' && p[3] <= '9';
+}
+
+BlockSource *bz2_source_open(int fd, int threads, const std::vector<block_span_t> *blocks, uint64_t skip)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return NULL;
+
+  size_t size = st.st_size;
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  std::vector<block_span_t> found;
+  if (!blocks)
+  {
+    bz2_find_blocks((const uint8_t *)map, size, found);
+    blocks = &found;
+  }
+  return new Bz2Source((const uint8_t *)map, size, *blocks, threads, skip);
+}
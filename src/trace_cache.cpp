@@ -0,0 +1,226 @@
+//========================================================//
+//  trace_cache.cpp                                       //
+//  Persistent cache of decoded traces                    //
+//                                                        //
+//  The first run over a trace writes a binary copy into  //
+//  the cache directory as it decodes; later runs map     //
+//  that copy instead of decompressing and parsing.       //
+//========================================================//
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+// Bumped whenever the cached representation changes
+#define CACHE_VERSION 1
+
+//------------------------------------//
+//             Cache Keys             //
+//------------------------------------//
+
+uint64_t trace_file_hash(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return 0;
+  }
+
+  // FNV-1a over the size and the contents, 8 bytes at a time
+  const uint64_t prime = 0x100000001B3ull;
+  uint64_t h = 0xCBF29CE484222325ull ^ (uint64_t)st.st_size;
+  h *= prime;
+
+  size_t size = st.st_size;
+  const uint8_t *p = NULL;
+  if (size > 0)
+  {
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+      close(fd);
+      return 0;
+    }
+    p = (const uint8_t *)map;
+    madvise(map, size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8)
+  {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * prime;
+  }
+  for (; i < size; i++)
+    h = (h ^ p[i]) * prime;
+
+  if (p)
+    munmap((void *)p, size);
+  return h;
+}
+
+//------------------------------------//
+//          Filling the Cache         //
+//------------------------------------//
+
+// Passes records through from 'inner' while appending them to a
+// temporary binary trace, which is renamed into the cache once the
+// whole trace has been read
+class CachingReader : public TraceReader
+{
+public:
+  CachingReader(TraceReader *inner, FILE *out, const char *tmp, const char *final_path,
+                const trace_meta_t *meta);
+  ~CachingReader();
+  int next(branch_t *br);
+  size_t next_batch(branch_batch_t *b);
+
+private:
+  TraceReader *inner;
+  FILE *out;
+  BinaryTraceWriter *writer;
+  char *tmp;
+  char *final_path;
+  int ok;       // still worth caching
+  int complete; // copy finished and published
+
+  void publish();
+};
+
+CachingReader::CachingReader(TraceReader *inner, FILE *out, const char *tmp,
+                             const char *final_path, const trace_meta_t *meta)
+    : inner(inner), out(out), ok(1), complete(0)
+{
+  this->tmp = strdup(tmp);
+  this->final_path = strdup(final_path);
+  writer = new BinaryTraceWriter(out, meta);
+}
+
+CachingReader::~CachingReader()
+{
+  delete writer;
+  if (out)
+    fclose(out);
+  if (!complete)
+    unlink(tmp);
+  free(tmp);
+  free(final_path);
+  delete inner;
+}
+
+void CachingReader::publish()
+{
+  if (!ok)
+    return;
+  ok = 0;
+  int good = writer->finish() >= 0;
+  good = (fclose(out) == 0) && good;
+  out = NULL;
+  if (good && rename(tmp, final_path) == 0)
+    complete = 1;
+  else
+    fprintf(stderr, "Warning: unable to write trace cache %s\n", final_path);
+}
+
+int CachingReader::next(branch_t *br)
+{
+  if (!inner->next(br))
+  {
+    publish();
+    return 0;
+  }
+  if (ok)
+  {
+    int flags = pack_flags(br);
+    ok = flags >= 0 && writer->add(br->pc, br->target, flags);
+  }
+  return 1;
+}
+
+size_t CachingReader::next_batch(branch_batch_t *b)
+{
+  size_t n = inner->next_batch(b);
+  if (n == 0)
+    publish();
+  else if (ok)
+    ok = writer->add_batch(b);
+  return n;
+}
+
+//------------------------------------//
+//             Interface              //
+//------------------------------------//
+
+TraceReader *trace_open_cached(const char *path, const char *cache_dir)
+{
+  // Traces that are already binary gain nothing from a copy
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  uint8_t magic[sizeof(ctrace_header_t)];
+  ssize_t n = pread(fd, magic, sizeof(magic), 0);
+  close(fd);
+  if (n > 0 && (is_btrace(magic, n) || is_ctrace(magic, n)))
+    return trace_open_file(path);
+
+  uint64_t key = trace_file_hash(path);
+  size_t len = strlen(cache_dir) + 64;
+  char *cached = (char *)malloc(len);
+  snprintf(cached, len, "%s/%016llx-v%d.bpt", cache_dir, (unsigned long long)key, CACHE_VERSION);
+
+  // Warm: map the decoded copy
+  struct stat st;
+  if (key && stat(cached, &st) == 0)
+  {
+    TraceReader *reader = trace_open_file(cached);
+    if (reader)
+    {
+      free(cached);
+      return reader;
+    }
+  }
+
+  TraceReader *inner = trace_open_file(path);
+  if (!inner || !key)
+  {
+    free(cached);
+    return inner;
+  }
+
+  // Cold: decode as usual and fill the cache on the way
+  if (mkdir(cache_dir, 0777) != 0 && errno != EEXIST)
+  {
+    fprintf(stderr, "Warning: unable to create trace cache %s\n", cache_dir);
+    free(cached);
+    return inner;
+  }
+  char *tmp = (char *)malloc(len + 32);
+  snprintf(tmp, len + 32, "%s.tmp%d", cached, (int)getpid());
+  FILE *out = fopen(tmp, "wb");
+  if (!out)
+  {
+    fprintf(stderr, "Warning: unable to write trace cache %s\n", tmp);
+    free(tmp);
+    free(cached);
+    return inner;
+  }
+
+  trace_meta_t meta;
+  if (!trace_find_meta(path, &meta))
+    memset(&meta, 0, sizeof(meta));
+
+  TraceReader *reader = new CachingReader(inner, out, tmp, cached, &meta);
+  free(tmp);
+  free(cached);
+  return reader;
+}
@@ -0,0 +1,648 @@
+//========================================================//
+//  trace_compact.cpp                                     //
+//  Compact trace format: static-branch dictionary plus   //
+//  range-coded successor tokens and outcomes             //
+//========================================================//
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+#include "trace.h"
+
+//------------------------------------//
+//           Range Coding             //
+//------------------------------------//
+
+// An adaptive binary range coder as in LZMA. A context holds the
+// probability of a 0 in 12 bits and moves 1/2^shift of the way toward
+// each bit coded with it.
+#define RC_PROB_BITS 12
+#define RC_PROB_INIT (1 << (RC_PROB_BITS - 1))
+#define RC_TOP (1u << 24)
+
+#define TOKEN_SHIFT 4
+#define TOKEN_CTX_BITS 16   // log2 of the token contexts
+#define OUTCOME_TABLES 4
+#define OUTCOME_CTX_BITS 20 // log2 of the contexts of an outcome table
+#define OUTCOME_SHIFT 4
+#define MIXER_SET_BITS 10   // log2 of the mixer weight sets
+#define MIXER_RATE 10       // weights move by stretch * error / 2^MIXER_RATE
+
+// Global outcomes each outcome table is indexed with, besides the branch
+static const int OUTCOME_LENGTHS[OUTCOME_TABLES] = {10, 24, 48, 63};
+
+struct RangeEncoder
+{
+  std::vector<uint8_t> out;
+  uint64_t low;
+  uint32_t range;
+  uint8_t cache;
+  uint64_t pending; // bytes held back until a carry is resolved
+
+  RangeEncoder() : low(0), range(0xFFFFFFFF), cache(0), pending(1) {}
+
+  void shift_low()
+  {
+    if ((uint32_t)low < 0xFF000000u || (low >> 32) != 0)
+    {
+      uint8_t carry = (uint8_t)(low >> 32);
+      uint8_t b = cache;
+      do
+      {
+        out.push_back((uint8_t)(b + carry));
+        b = 0xFF;
+      } while (--pending != 0);
+      cache = (uint8_t)(low >> 24);
+    }
+    pending++;
+    low = (low & 0x00FFFFFF) << 8;
+  }
+
+  // Code 'bit' with probability p0 / 2^RC_PROB_BITS of a 0
+  void encode_p(uint32_t p0, int bit)
+  {
+    uint32_t bound = (range >> RC_PROB_BITS) * p0;
+    if (!bit)
+    {
+      range = bound;
+    }
+    else
+    {
+      low += bound;
+      range -= bound;
+    }
+    while (range < RC_TOP)
+    {
+      range <<= 8;
+      shift_low();
+    }
+  }
+
+  void encode(uint16_t *p, int bit, int shift)
+  {
+    encode_p(*p, bit);
+    if (!bit)
+      *p += ((1 << RC_PROB_BITS) - *p) >> shift;
+    else
+      *p -= *p >> shift;
+  }
+
+  void flush()
+  {
+    for (int i = 0; i < 5; i++)
+      shift_low();
+  }
+};
+
+// Reads exactly the bytes the encoder wrote, pulling each from 'in'
+struct RangeDecoder
+{
+  uint32_t range;
+  uint32_t code;
+
+  template <class In> void init(In in)
+  {
+    range = 0xFFFFFFFF;
+    code = 0;
+    for (int i = 0; i < 5; i++)
+      code = (code << 8) | in();
+  }
+
+  template <class In> int decode_p(uint32_t p0, In in)
+  {
+    uint32_t bound = (range >> RC_PROB_BITS) * p0;
+    int bit;
+    if (code < bound)
+    {
+      range = bound;
+      bit = 0;
+    }
+    else
+    {
+      code -= bound;
+      range -= bound;
+      bit = 1;
+    }
+    while (range < RC_TOP)
+    {
+      range <<= 8;
+      code = (code << 8) | in();
+    }
+    return bit;
+  }
+
+  template <class In> int decode(uint16_t *p, int shift, In in)
+  {
+    int bit = decode_p(*p, in);
+    if (!bit)
+      *p += ((1 << RC_PROB_BITS) - *p) >> shift;
+    else
+      *p -= *p >> shift;
+    return bit;
+  }
+};
+
+// Logistic function 4096 / (1 + e^(-d / 256)), interpolated
+static int squash(int d)
+{
+  static const int t[33] = {1,    2,    4,    6,    10,   17,   27,   45,   74,   120,  194,
+                            311,  488,  747,  1102, 1546, 2048, 2550, 2994, 3349, 3608, 3785,
+                            3902, 3976, 4022, 4051, 4069, 4079, 4086, 4090, 4092, 4094, 4095};
+  if (d > 2047)
+    return 4095;
+  if (d < -2047)
+    return 1;
+  int w = d & 127;
+  d = (d >> 7) + 16;
+  return (t[d] * (128 - w) + t[d + 1] * w + 64) >> 7;
+}
+
+// The contexts of both streams, updated in the same order by the
+// writer and the reader
+struct CompactModel
+{
+  std::vector<uint16_t> tokenProbs;
+  uint64_t prevToken;
+
+  // Each outcome table holds the probability of taken for a branch
+  // under the newest OUTCOME_LENGTHS[t] outcomes; a mixer, picked by
+  // branch, weighs their predictions
+  std::vector<uint16_t> outcomeProbs[OUTCOME_TABLES];
+  std::vector<int32_t> weights;
+  int16_t stretchTab[1 << RC_PROB_BITS];
+  uint64_t history; // conditional outcomes, newest in bit 0
+  uint32_t slot[OUTCOME_TABLES];
+  int st[OUTCOME_TABLES + 1];
+  int32_t *w;
+  int pr;
+
+  RangeDecoder tokenRc;
+  RangeDecoder outcomeRc;
+
+  CompactModel()
+      : tokenProbs(1 << TOKEN_CTX_BITS, RC_PROB_INIT), prevToken(0),
+        weights((OUTCOME_TABLES + 1) << MIXER_SET_BITS, (1 << 16) / 2), history(0)
+  {
+    for (int t = 0; t < OUTCOME_TABLES; t++)
+      outcomeProbs[t].assign(1 << OUTCOME_CTX_BITS, RC_PROB_INIT);
+    // The inverse of squash()
+    int pi = 0;
+    for (int x = -2047; x <= 2047; x++)
+    {
+      int v = squash(x);
+      for (int j = pi; j <= v; j++)
+        stretchTab[j] = x;
+      pi = v + 1;
+    }
+    for (int j = pi; j < (1 << RC_PROB_BITS); j++)
+      stretchTab[j] = 2047;
+  }
+
+  // Bit 'node' of a bit tree over byte 'k' of a varint token
+  uint16_t *token_prob(uint32_t k, uint32_t node)
+  {
+    uint32_t h = (uint32_t)(((prevToken * 0x9E3779B97F4A7C15ull) ^ k) * 0xD6E8FEB86659FD93ull >> 32);
+    return &tokenProbs[(h + node * 0x9E3779B1u) >> (32 - TOKEN_CTX_BITS)];
+  }
+
+  // Probability of a 0 (not taken) for conditional branch 'id'
+  uint32_t outcome_p0(uint32_t id)
+  {
+    int64_t dot = 0;
+    w = &weights[(size_t)(id & ((1 << MIXER_SET_BITS) - 1)) * (OUTCOME_TABLES + 1)];
+    for (int t = 0; t < OUTCOME_TABLES; t++)
+    {
+      uint64_t h = history & ((1ull << OUTCOME_LENGTHS[t]) - 1);
+      uint64_t key = (h * 0xD6E8FEB86659FD93ull) ^ ((uint64_t)id << 8 | t);
+      slot[t] = (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> (64 - OUTCOME_CTX_BITS));
+      st[t] = stretchTab[outcomeProbs[t][slot[t]]];
+      dot += (int64_t)w[t] * st[t];
+    }
+    st[OUTCOME_TABLES] = 256;
+    dot += (int64_t)w[OUTCOME_TABLES] * 256;
+    pr = squash((int)(dot >> 16));
+    return (1 << RC_PROB_BITS) - pr;
+  }
+
+  void outcome_update(int taken)
+  {
+    int err = (taken << RC_PROB_BITS) - pr;
+    for (int t = 0; t <= OUTCOME_TABLES; t++)
+      w[t] += (st[t] * err) >> MIXER_RATE;
+    for (int t = 0; t < OUTCOME_TABLES; t++)
+    {
+      uint16_t *p = &outcomeProbs[t][slot[t]];
+      if (taken)
+        *p += ((1 << RC_PROB_BITS) - *p) >> OUTCOME_SHIFT;
+      else
+        *p -= *p >> OUTCOME_SHIFT;
+    }
+    history = (history << 1) | taken;
+  }
+};
+
+// Code a varint token one byte at a time, each byte as a bit tree
+static void encode_token(RangeEncoder &rc, CompactModel &m, uint64_t v)
+{
+  uint64_t rest = v;
+  for (uint32_t k = 0;; k++)
+  {
+    uint32_t byte = rest & 0x7F;
+    rest >>= 7;
+    if (rest)
+      byte |= 0x80;
+    uint32_t node = 1;
+    for (int b = 7; b >= 0; b--)
+    {
+      int bit = (byte >> b) & 1;
+      rc.encode(m.token_prob(k, node), bit, TOKEN_SHIFT);
+      node = (node << 1) | bit;
+    }
+    if (!rest)
+      break;
+  }
+  m.prevToken = v;
+}
+
+//------------------------------------//
+//              Writer                //
+//------------------------------------//
+
+struct StaticKey
+{
+  uint32_t pc;
+  uint32_t target;
+  uint8_t flags;
+
+  bool operator==(const StaticKey &o) const
+  {
+    return pc == o.pc && target == o.target && flags == o.flags;
+  }
+};
+
+struct StaticKeyHash
+{
+  size_t operator()(const StaticKey &k) const
+  {
+    uint64_t h = ((uint64_t)k.pc << 32 | k.target) * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h ^ (h >> 29) ^ k.flags);
+  }
+};
+
+int64_t ctrace_write(TraceReader *in, FILE *out, const trace_meta_t *meta)
+{
+  std::unordered_map<StaticKey, uint32_t, StaticKeyHash> index;
+  std::vector<btrace_rec_t> dict;
+  std::vector<uint32_t> succ;
+  CompactModel model;
+  RangeEncoder tokens;
+  RangeEncoder outcomes;
+
+  ctrace_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CTRACE_MAGIC, sizeof(CTRACE_MAGIC));
+  hdr.version = CTRACE_VERSION;
+  hdr.header_size = sizeof(ctrace_header_t);
+  if (meta)
+    hdr.meta = *meta;
+
+  int64_t prevCtx = -1;
+  uint64_t run = 0;
+  branch_t br;
+  while (in->next(&br))
+  {
+    int flags = pack_flags(&br);
+    if (flags < 0)
+    {
+      fprintf(stderr, "Branch %llu has a flag outside 0/1\n", (unsigned long long)hdr.num_records);
+      return -1;
+    }
+
+    // Conditional outcomes go to the outcome stream, not the dictionary
+    StaticKey key;
+    key.pc = br.pc;
+    key.target = br.target;
+    key.flags = (flags & BR_COND) ? (flags & ~BR_TAKEN) : flags;
+
+    uint32_t id;
+    std::unordered_map<StaticKey, uint32_t, StaticKeyHash>::iterator it = index.find(key);
+    if (it == index.end())
+    {
+      id = dict.size();
+      index[key] = id;
+      btrace_rec_t rec;
+      memset(&rec, 0, sizeof(rec));
+      rec.pc = key.pc;
+      rec.target = key.target;
+      rec.flags = key.flags;
+      dict.push_back(rec);
+      succ.push_back(UINT32_MAX);
+      succ.push_back(UINT32_MAX);
+    }
+    else
+    {
+      id = it->second;
+    }
+
+    if (prevCtx >= 0 && succ[prevCtx] == id)
+    {
+      run++;
+    }
+    else
+    {
+      if (run)
+        encode_token(tokens, model, run << 1);
+      run = 0;
+      encode_token(tokens, model, ((uint64_t)id << 1) | 1);
+      if (prevCtx >= 0)
+        succ[prevCtx] = id;
+    }
+
+    if (flags & BR_COND)
+    {
+      int taken = (flags & BR_TAKEN) != 0;
+      outcomes.encode_p(model.outcome_p0(id), taken);
+      model.outcome_update(taken);
+      hdr.outcome_bits++;
+    }
+
+    prevCtx = 2 * (int64_t)id + (flags & BR_TAKEN ? 1 : 0);
+    hdr.num_records++;
+  }
+  if (run)
+    encode_token(tokens, model, run << 1);
+  tokens.flush();
+  outcomes.flush();
+
+  hdr.num_static = dict.size();
+  hdr.token_bytes = tokens.out.size();
+  hdr.outcome_bytes = outcomes.out.size();
+
+  if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+      fwrite(dict.data(), sizeof(btrace_rec_t), dict.size(), out) != dict.size() ||
+      fwrite(tokens.out.data(), 1, tokens.out.size(), out) != tokens.out.size() ||
+      fwrite(outcomes.out.data(), 1, outcomes.out.size(), out) != outcomes.out.size())
+  {
+    return -1;
+  }
+  return hdr.num_records;
+}
+
+//------------------------------------//
+//              Reader                //
+//------------------------------------//
+
+int is_ctrace(const uint8_t *p, size_t size)
+{
+  if (size < sizeof(ctrace_header_t))
+    return 0;
+  const ctrace_header_t *hdr = (const ctrace_header_t *)p;
+  return memcmp(hdr->magic, CTRACE_MAGIC, sizeof(CTRACE_MAGIC)) == 0;
+}
+
+CompactTraceReader::CompactTraceReader(ByteSource *src)
+    : src(src), cur(NULL), end(NULL), dict(NULL), tokens(NULL), model(NULL), bitsLeft(0), outcomeLeft(0),
+      left(0), run(0), succ(NULL), prevCtx(-1), truncated(0), ok(0)
+{
+  if (!read_exact(&hdr, sizeof(hdr)) || !is_ctrace((const uint8_t *)&hdr, sizeof(hdr)) ||
+      hdr.version != CTRACE_VERSION || hdr.header_size < sizeof(hdr))
+  {
+    fprintf(stderr, "Unsupported or truncated compact trace\n");
+    return;
+  }
+
+  // Every static branch occurs at least once, and an ID must leave
+  // UINT32_MAX free to mark a missing successor
+  if (hdr.num_static > hdr.num_records || hdr.num_static == UINT32_MAX)
+  {
+    fprintf(stderr, "Corrupt compact trace\n");
+    return;
+  }
+
+  // Skip header fields added by later minor revisions
+  uint64_t skip = hdr.header_size - sizeof(hdr);
+  char scratch[64];
+  while (skip > 0)
+  {
+    size_t n = skip < sizeof(scratch) ? skip : sizeof(scratch);
+    if (!read_exact(scratch, n))
+    {
+      fprintf(stderr, "Truncated compact trace\n");
+      return;
+    }
+    skip -= n;
+  }
+
+  // The sizes in the header are only trusted as far as the data is there
+  dict = (btrace_rec_t *)read_alloc((uint64_t)hdr.num_static * sizeof(btrace_rec_t));
+  tokens = dict ? (uint8_t *)read_alloc(hdr.token_bytes) : NULL;
+  if (!dict || !tokens)
+  {
+    fprintf(stderr, "Truncated compact trace\n");
+    return;
+  }
+  succ = (uint32_t *)malloc(2 * (size_t)hdr.num_static * sizeof(uint32_t) + 1);
+  model = new CompactModel();
+  if (!succ)
+  {
+    fprintf(stderr, "Out of memory reading compact trace\n");
+    return;
+  }
+  memset(succ, 0xFF, 2 * (size_t)hdr.num_static * sizeof(uint32_t));
+
+  tok = tokens;
+  tokEnd = tokens + hdr.token_bytes;
+  bitsLeft = hdr.outcome_bits;
+  outcomeLeft = hdr.outcome_bytes;
+  left = hdr.num_records;
+  model->tokenRc.init([this] { return token_byte(); });
+  model->outcomeRc.init([this] { return outcome_byte(); });
+  ok = 1;
+}
+
+CompactTraceReader::~CompactTraceReader()
+{
+  free(dict);
+  free(tokens);
+  free(succ);
+  delete model;
+  delete src;
+}
+
+int CompactTraceReader::read_exact(void *dst, size_t n)
+{
+  char *p = (char *)dst;
+  while (n > 0)
+  {
+    if (cur == end)
+    {
+      size_t len = src->next(&cur);
+      if (len == 0)
+      {
+        cur = end = NULL;
+        return 0;
+      }
+      end = cur + len;
+    }
+    size_t take = (size_t)(end - cur) < n ? (size_t)(end - cur) : n;
+    memcpy(p, cur, take);
+    cur += take;
+    p += take;
+    n -= take;
+  }
+  return 1;
+}
+
+// Read 'n' bytes into a buffer grown as they arrive, so that a corrupt
+// size fails on the missing bytes rather than on the allocation
+//
+// Returns the malloc'd buffer, or NULL if the stream ends first
+//
+void *CompactTraceReader::read_alloc(uint64_t n)
+{
+  const uint64_t STEP = 1 << 20;
+  char *buf = (char *)malloc(n < STEP ? n + 1 : STEP);
+  uint64_t have = 0;
+  while (buf && have < n)
+  {
+    uint64_t take = n - have < STEP ? n - have : STEP;
+    if (have > 0)
+    {
+      char *grown = (char *)realloc(buf, have + take);
+      if (!grown)
+        break;
+      buf = grown;
+    }
+    if (!read_exact(buf + have, take))
+      break;
+    have += take;
+  }
+  if (have < n)
+  {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+uint8_t CompactTraceReader::token_byte()
+{
+  // Past the end of the tokens only on a corrupt trace, which the
+  // decoded tokens then give away
+  return tok < tokEnd ? *tok++ : 0;
+}
+
+uint8_t CompactTraceReader::outcome_byte()
+{
+  if (outcomeLeft == 0)
+  {
+    truncated = 1;
+    return 0;
+  }
+  outcomeLeft--;
+  if (cur < end)
+    return (uint8_t)*cur++;
+  uint8_t b;
+  if (!read_exact(&b, 1))
+  {
+    truncated = 1;
+    return 0;
+  }
+  return b;
+}
+
+// Decode the next varint token
+//
+// Returns True if Successful
+//
+int CompactTraceReader::token(uint64_t *v)
+{
+  uint64_t value = 0;
+  for (uint32_t k = 0;; k++)
+  {
+    // A 64-bit value takes at most 10 bytes
+    if (k == 10)
+      return 0;
+    uint32_t node = 1;
+    for (int b = 0; b < 8; b++)
+    {
+      node = (node << 1) | model->tokenRc.decode(model->token_prob(k, node), TOKEN_SHIFT,
+                                                 [this] { return token_byte(); });
+    }
+    uint64_t bits = node & 0x7F;
+    if (k == 9 && bits > 1)
+      return 0;
+    value |= bits << (7 * k);
+    if (!(node & 0x80))
+      break;
+  }
+  model->prevToken = value;
+  *v = value;
+  return 1;
+}
+
+int CompactTraceReader::next(branch_t *br)
+{
+  if (left == 0)
+    return 0;
+
+  uint32_t id;
+  if (run == 0)
+  {
+    uint64_t v;
+    if (!token(&v))
+    {
+      fprintf(stderr, "Corrupt compact trace\n");
+      left = 0;
+      return 0;
+    }
+
+    if (v & 1)
+    {
+      id = v >> 1 < UINT32_MAX ? (uint32_t)(v >> 1) : UINT32_MAX;
+      if (prevCtx >= 0 && id < hdr.num_static)
+        succ[prevCtx] = id;
+    }
+    else
+    {
+      run = v >> 1;
+      id = UINT32_MAX;
+      if (prevCtx < 0)
+        run = 0;
+    }
+  }
+  if (run)
+  {
+    id = succ[prevCtx];
+    run--;
+  }
+  if (id >= hdr.num_static || ((dict[id].flags & BR_COND) && bitsLeft == 0))
+  {
+    fprintf(stderr, "Corrupt compact trace\n");
+    left = 0;
+    return 0;
+  }
+
+  const btrace_rec_t *rec = &dict[id];
+  uint8_t flags = rec->flags;
+  if (flags & BR_COND)
+  {
+    int taken = model->outcomeRc.decode_p(model->outcome_p0(id), [this] { return outcome_byte(); });
+    if (truncated)
+    {
+      fprintf(stderr, "Truncated compact trace\n");
+      left = 0;
+      return 0;
+    }
+    model->outcome_update(taken);
+    flags |= taken ? BR_TAKEN : 0;
+    bitsLeft--;
+  }
+
+  br->pc = rec->pc;
+  br->target = rec->target;
+  unpack_flags(flags, br);
+
+  prevCtx = 2 * (int64_t)id + br->outcome;
+  left--;
+  return 1;
+}
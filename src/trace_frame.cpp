@@ -0,0 +1,322 @@
+//========================================================//
+//  trace_frame.cpp                                       //
+//  zstd and lz4 decoding of trace files                  //
+//                                                        //
+//  A file made of several independent frames has them    //
+//  decompressed on worker threads when the libraries are //
+//  built in; otherwise the zstd or lz4 command is run.   //
+//========================================================//
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <vector>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#include "trace.h"
+
+extern char **environ;
+
+#define ZSTD_FRAME_MAGIC 0xFD2FB528u
+#define LZ4_FRAME_MAGIC 0x184D2204u
+
+// Skippable frames, shared by both formats, use any of 16 magics
+#define SKIPPABLE_MAGIC 0x184D2A50u
+#define SKIPPABLE_MASK 0xFFFFFFF0u
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+//------------------------------------//
+//            Frame Scan              //
+//------------------------------------//
+
+// Size of the lz4 frame at 'p', or 0 if it is truncated
+//
+static size_t lz4_frame_size(const uint8_t *p, size_t size)
+{
+  if (size < 7)
+    return 0;
+  uint8_t flg = p[4];
+  size_t pos = 4 + 2 + ((flg & 0x08) ? 8 : 0) + ((flg & 0x01) ? 4 : 0) + 1;
+  size_t checksum = (flg & 0x10) ? 4 : 0;
+
+  // Blocks, up to the zero end mark
+  for (;;)
+  {
+    if (pos + 4 > size)
+      return 0;
+    uint32_t len = get_le32(p + pos) & 0x7FFFFFFF;
+    pos += 4;
+    if (len == 0)
+      break;
+    pos += len + checksum;
+  }
+  if (flg & 0x04)
+    pos += 4;
+  return pos <= size ? pos : 0;
+}
+
+// Size of the zstd frame at 'p', or 0 if it is malformed
+//
+static size_t zstd_frame_size(const uint8_t *p, size_t size)
+{
+#ifdef HAVE_ZSTD
+  size_t n = ZSTD_findFrameCompressedSize(p, size);
+  return ZSTD_isError(n) ? 0 : n;
+#else
+  return 0;
+#endif
+}
+
+int frame_find(int format, const uint8_t *p, size_t size, std::vector<block_span_t> &frames)
+{
+  size_t pos = 0;
+  while (pos < size)
+  {
+    if (size - pos < 8)
+      return 0;
+    uint32_t magic = get_le32(p + pos);
+    size_t n;
+    if ((magic & SKIPPABLE_MASK) == SKIPPABLE_MAGIC)
+    {
+      pos += 8 + (size_t)get_le32(p + pos + 4);
+      continue;
+    }
+    else if (format == FRAME_ZSTD && magic == ZSTD_FRAME_MAGIC)
+      n = zstd_frame_size(p + pos, size - pos);
+    else if (format == FRAME_LZ4 && magic == LZ4_FRAME_MAGIC)
+      n = lz4_frame_size(p + pos, size - pos);
+    else
+      return 0;
+    if (n == 0)
+      return 0;
+
+    block_span_t f;
+    f.start = pos;
+    f.end = pos + n;
+    frames.push_back(f);
+    pos += n;
+  }
+  return pos == size;
+}
+
+//------------------------------------//
+//          Frame Decoding            //
+//------------------------------------//
+
+#ifdef HAVE_ZSTD
+static int zstd_decode(const uint8_t *p, size_t n, std::vector<char> &out)
+{
+  ZSTD_DStream *ds = ZSTD_createDStream();
+  if (!ds)
+    return 0;
+
+  unsigned long long known = ZSTD_getFrameContentSize(p, n);
+  size_t want = known < ((unsigned long long)1 << 32) ? known + 1 : 1 << 20;
+  out.resize(out.capacity() > want ? out.capacity() : want);
+  ZSTD_inBuffer in = {p, n, 0};
+  ZSTD_outBuffer ob = {&out[0], out.size(), 0};
+  size_t rc;
+  do
+  {
+    if (ob.pos == ob.size)
+    {
+      out.resize(out.size() * 2);
+      ob.dst = &out[0];
+      ob.size = out.size();
+    }
+    rc = ZSTD_decompressStream(ds, &ob, &in);
+  } while (!ZSTD_isError(rc) && (in.pos < in.size || (rc != 0 && ob.pos == ob.size)));
+
+  ZSTD_freeDStream(ds);
+  out.resize(ob.pos);
+  return !ZSTD_isError(rc) && rc == 0;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static int lz4_decode(const uint8_t *p, size_t n, std::vector<char> &out)
+{
+  LZ4F_dctx *dc;
+  if (LZ4F_isError(LZ4F_createDecompressionContext(&dc, LZ4F_VERSION)))
+    return 0;
+
+  out.resize(out.capacity() > (1 << 20) ? out.capacity() : 1 << 20);
+  size_t produced = 0;
+  size_t consumed = 0;
+  size_t rc;
+  do
+  {
+    if (produced == out.size())
+      out.resize(out.size() * 2);
+    size_t dstLen = out.size() - produced;
+    size_t srcLen = n - consumed;
+    rc = LZ4F_decompress(dc, &out[produced], &dstLen, p + consumed, &srcLen, NULL);
+    produced += dstLen;
+    consumed += srcLen;
+  } while (!LZ4F_isError(rc) && rc != 0 && (consumed < n || produced == out.size()));
+
+  LZ4F_freeDecompressionContext(dc);
+  out.resize(produced);
+  return !LZ4F_isError(rc) && rc == 0;
+}
+#endif
+
+class FrameSource : public BlockSource
+{
+public:
+  FrameSource(const uint8_t *data, size_t size, const std::vector<block_span_t> &frames, int format,
+              int threads, uint64_t skip)
+      : BlockSource(data, size, frames, skip), format(format)
+  {
+    start(threads);
+  }
+  ~FrameSource() { finish(); }
+
+protected:
+  int decode(uint64_t start, uint64_t end, std::vector<char> &out)
+  {
+#ifdef HAVE_ZSTD
+    if (format == FRAME_ZSTD)
+      return zstd_decode(data + start, end - start, out);
+#endif
+#ifdef HAVE_LZ4
+    if (format == FRAME_LZ4)
+      return lz4_decode(data + start, end - start, out);
+#endif
+    return 0;
+  }
+
+private:
+  int format;
+};
+
+//------------------------------------//
+//         External Decoders          //
+//------------------------------------//
+
+// Reads the output of a decoder process, which is reaped on destruction
+class CommandSource : public ByteSource
+{
+public:
+  CommandSource(FILE *fp, pid_t pid, const char *name) : pid(pid), name(name)
+  {
+    in = new FileSource(fp, 1);
+  }
+  ~CommandSource()
+  {
+    // Closing the pipe stops a decoder that is still writing
+    delete in;
+    int status;
+    if (waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) != 0)
+      fprintf(stderr, "Warning: %s failed to decode the trace\n", name);
+  }
+  size_t next(const char **data) { return in->next(data); }
+
+private:
+  FileSource *in;
+  pid_t pid;
+  const char *name;
+};
+
+//------------------------------------//
+//             Interface              //
+//------------------------------------//
+
+int frame_format(const uint8_t *p, size_t size)
+{
+  if (size < 4)
+    return 0;
+  uint32_t magic = get_le32(p);
+  if (magic == ZSTD_FRAME_MAGIC)
+    return FRAME_ZSTD;
+  if (magic == LZ4_FRAME_MAGIC)
+    return FRAME_LZ4;
+  return 0;
+}
+
+int frame_native(int format)
+{
+#ifdef HAVE_ZSTD
+  if (format == FRAME_ZSTD)
+    return 1;
+#endif
+#ifdef HAVE_LZ4
+  if (format == FRAME_LZ4)
+    return 1;
+#endif
+  return 0;
+}
+
+BlockSource *frame_source_open(int fd, int format, int threads, const std::vector<block_span_t> *frames,
+                               uint64_t skip)
+{
+  struct stat st;
+  if (!frame_native(format) || fstat(fd, &st) != 0 || st.st_size == 0)
+    return NULL;
+
+  size_t size = st.st_size;
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  std::vector<block_span_t> found;
+  if (!frames)
+  {
+    if (!frame_find(format, (const uint8_t *)map, size, found))
+    {
+      fprintf(stderr, "Malformed %s trace\n", format == FRAME_ZSTD ? "zstd" : "lz4");
+      munmap(map, size);
+      return NULL;
+    }
+    frames = &found;
+  }
+  return new FrameSource((const uint8_t *)map, size, *frames, format, threads, skip);
+}
+
+ByteSource *frame_command_open(int fd, int format)
+{
+  const char *name = format == FRAME_ZSTD ? "zstd" : "lz4";
+  const char *argv[] = {name, "-dc", NULL};
+
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) != 0)
+    return NULL;
+
+  // The decoder reads the trace on stdin and writes the pipe
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, fd, 0);
+  posix_spawn_file_actions_adddup2(&fa, pipefd[1], 1);
+  pid_t pid;
+  int rc = posix_spawnp(&pid, name, &fa, NULL, (char *const *)argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  close(pipefd[1]);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "Unable to run %s to decode the trace\n", name);
+    close(pipefd[0]);
+    return NULL;
+  }
+  FILE *fp = fdopen(pipefd[0], "r");
+  if (!fp)
+  {
+    // The decoder exits on the closed pipe
+    close(pipefd[0]);
+    waitpid(pid, NULL, 0);
+    return NULL;
+  }
+  return new CommandSource(fp, pid, name);
+}
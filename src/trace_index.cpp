@@ -0,0 +1,314 @@
+//========================================================//
+//  trace_index.cpp                                       //
+//  Sidecar index of a text or bzip2 trace, for starting  //
+//  a run at an arbitrary branch                          //
+//========================================================//
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+#include "trace.h"
+
+static uint64_t mtime_ns(const struct stat *st)
+{
+  return (uint64_t)st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec;
+}
+
+// '<path>.idx', to be freed by the caller
+//
+static char *index_path(const char *path)
+{
+  char *idx = (char *)malloc(strlen(path) + 5);
+  strcpy(idx, path);
+  strcat(idx, ".idx");
+  return idx;
+}
+
+//------------------------------------//
+//              Writer                //
+//------------------------------------//
+
+// Add a checkpoint every TINDEX_INTERVAL lines of a mapped text trace
+//
+// Returns the number of records
+//
+static int64_t text_index(const char *p, size_t size, std::vector<tindex_entry_t> &entries)
+{
+  const char *end = p + size;
+  const char *line = p;
+  uint64_t lines = 0;
+  while (line < end)
+  {
+    if (lines % TINDEX_INTERVAL == 0)
+    {
+      tindex_entry_t e;
+      e.start = line - p;
+      e.end = 0;
+      e.record = lines;
+      e.skip = 0;
+      entries.push_back(e);
+    }
+    lines++;
+    const char *nl = (const char *)memchr(line, '\n', end - line);
+    if (!nl)
+      break;
+    line = nl + 1;
+  }
+  return lines;
+}
+
+// Add a checkpoint for every block of a compressed trace
+//
+// Returns the number of records, or -1 on failure
+//
+static int64_t block_index(BlockSource *src, std::vector<tindex_entry_t> &entries)
+{
+  // Blocks split records anywhere; the first record of a block starts
+  // after its first newline unless the previous block ended with one
+  uint64_t lines = 0;
+  int at_line_start = 1;
+  const char *data;
+  size_t n;
+  while ((n = src->next(&data)) > 0)
+  {
+    tindex_entry_t e;
+    e.start = src->span().start;
+    e.end = src->span().end;
+    e.record = lines;
+    e.skip = 0;
+    if (!at_line_start)
+    {
+      const char *nl = (const char *)memchr(data, '\n', n);
+      e.record = lines + 1;
+      e.skip = nl ? (uint64_t)(nl - data + 1) : TINDEX_NO_RECORD;
+    }
+    entries.push_back(e);
+
+    for (const char *p = data; (p = (const char *)memchr(p, '\n', data + n - p)) != NULL; p++)
+      lines++;
+    at_line_start = data[n - 1] == '\n';
+  }
+  if (src->failed())
+    return -1;
+
+  // A final line without a trailing newline still counts
+  return lines + !at_line_start;
+}
+
+// Open the compressed trace on 'fd' of index kind 'kind' at 'blocks',
+// or at all of its blocks if NULL
+//
+static BlockSource *block_source_open(int fd, int kind, const std::vector<block_span_t> *blocks,
+                                      uint64_t skip)
+{
+  int threads = std::thread::hardware_concurrency();
+  if (kind == TINDEX_BZ2)
+    return bz2_source_open(fd, threads, blocks, skip);
+  if (kind == TINDEX_ZSTD)
+    return frame_source_open(fd, FRAME_ZSTD, threads, blocks, skip);
+  if (kind == TINDEX_LZ4)
+    return frame_source_open(fd, FRAME_LZ4, threads, blocks, skip);
+  return NULL;
+}
+
+// Index kind of a trace starting with 'magic'
+//
+static int index_kind(const uint8_t *magic, size_t n)
+{
+  if (is_bz2(magic, n))
+    return TINDEX_BZ2;
+  int format = frame_format(magic, n);
+  if (format == FRAME_ZSTD)
+    return TINDEX_ZSTD;
+  if (format == FRAME_LZ4)
+    return TINDEX_LZ4;
+  return TINDEX_TEXT;
+}
+
+int64_t trace_index_build(const char *path, const char *idx_path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  uint8_t magic[sizeof(ctrace_header_t)];
+  ssize_t n = pread(fd, magic, sizeof(magic), 0);
+  if (n < 0 || fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  if (is_btrace(magic, n) || is_ctrace(magic, n))
+  {
+    fprintf(stderr, "Binary and compact traces need no index\n");
+    close(fd);
+    return -1;
+  }
+
+  tindex_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TINDEX_MAGIC, sizeof(TINDEX_MAGIC));
+  hdr.version = TINDEX_VERSION;
+  hdr.source_size = st.st_size;
+  hdr.source_mtime = mtime_ns(&st);
+
+  std::vector<tindex_entry_t> entries;
+  int64_t records;
+  hdr.kind = index_kind(magic, n);
+  if (hdr.kind != TINDEX_TEXT)
+  {
+    BlockSource *src = block_source_open(fd, hdr.kind, NULL, 0);
+    if (!src)
+    {
+      fprintf(stderr, "This build can't decode the trace in-process\n");
+      close(fd);
+      return -1;
+    }
+    records = block_index(src, entries);
+    delete src;
+  }
+  else
+  {
+    records = 0;
+    if (st.st_size > 0)
+    {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED)
+      {
+        close(fd);
+        return -1;
+      }
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      records = text_index((const char *)map, st.st_size, entries);
+      munmap(map, st.st_size);
+    }
+  }
+  close(fd);
+  if (records < 0)
+    return -1;
+
+  hdr.num_records = records;
+  hdr.num_entries = entries.size();
+  FILE *out = fopen(idx_path, "wb");
+  if (!out)
+    return -1;
+  int ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1 &&
+           fwrite(entries.data(), sizeof(tindex_entry_t), entries.size(), out) == entries.size();
+  if (fclose(out) != 0 || !ok)
+  {
+    remove(idx_path);
+    return -1;
+  }
+  return entries.size();
+}
+
+//------------------------------------//
+//              Seeking               //
+//------------------------------------//
+
+// Read '<path>.idx' if it exists and was built from the trace as it
+// is now, described by 'st'
+//
+// Returns True if Successful
+//
+static int load_index(const char *path, const struct stat *st, tindex_header_t *hdr,
+                      std::vector<tindex_entry_t> &entries)
+{
+  char *idx = index_path(path);
+  FILE *fp = fopen(idx, "rb");
+  free(idx);
+  if (!fp)
+    return 0;
+
+  int ok = fread(hdr, sizeof(*hdr), 1, fp) == 1 &&
+           memcmp(hdr->magic, TINDEX_MAGIC, sizeof(TINDEX_MAGIC)) == 0 &&
+           hdr->version == TINDEX_VERSION && hdr->source_size == (uint64_t)st->st_size &&
+           hdr->source_mtime == mtime_ns(st) && hdr->num_entries < ((uint64_t)1 << 32);
+  if (ok)
+  {
+    entries.resize(hdr->num_entries);
+    ok = fread(entries.data(), sizeof(tindex_entry_t), entries.size(), fp) == entries.size();
+  }
+  fclose(fp);
+
+  // Entries must point inside the trace
+  uint64_t limit = hdr->kind == TINDEX_BZ2 ? hdr->source_size * 8 : hdr->source_size;
+  for (size_t i = 0; ok && i < entries.size(); i++)
+  {
+    if (hdr->kind == TINDEX_TEXT)
+      ok = entries[i].start < limit;
+    else
+      ok = entries[i].start < entries[i].end && entries[i].end <= limit;
+  }
+  if (!ok)
+    fprintf(stderr, "Warning: ignoring stale or unreadable index for %s\n", path);
+  return ok;
+}
+
+TraceReader *trace_open_at(const char *path, uint64_t first)
+{
+  if (first == 0)
+    return trace_open_file(path);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  uint8_t magic[sizeof(ctrace_header_t)];
+  ssize_t n = pread(fd, magic, sizeof(magic), 0);
+  tindex_header_t hdr;
+  std::vector<tindex_entry_t> entries;
+  TraceReader *reader = NULL;
+  uint64_t at = 0;
+
+  if (n > 0 && !is_btrace(magic, n) && !is_ctrace(magic, n) && fstat(fd, &st) == 0 &&
+      load_index(path, &st, &hdr, entries))
+  {
+    // Last checkpoint at or before 'first'
+    size_t k = entries.size();
+    for (size_t i = 0; i < entries.size() && entries[i].record <= first; i++)
+    {
+      if (entries[i].skip != TINDEX_NO_RECORD)
+        k = i;
+    }
+
+    ByteSource *src = NULL;
+    if (k == entries.size() || hdr.kind != index_kind(magic, n))
+      ; // before the first checkpoint, or not the indexed trace
+    else if (hdr.kind != TINDEX_TEXT)
+    {
+      std::vector<block_span_t> blocks(entries.size() - k);
+      for (size_t i = k; i < entries.size(); i++)
+      {
+        blocks[i - k].start = entries[i].start;
+        blocks[i - k].end = entries[i].end;
+      }
+      src = block_source_open(fd, hdr.kind, &blocks, entries[k].skip);
+    }
+    else
+    {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+        src = new MmapSource((const char *)map, st.st_size, entries[k].start);
+    }
+
+    if (src)
+    {
+      reader = new TextTraceReader(src);
+      at = entries[k].record;
+    }
+  }
+  close(fd);
+
+  // Without a usable checkpoint, read from the start
+  if (!reader)
+    reader = trace_open_file(path);
+  if (reader)
+    reader->skip(first - at);
+  return reader;
+}
@@ -0,0 +1,134 @@
+//========================================================//
+//  trace_pipe.cpp                                        //
+//  Decodes a trace on its own thread so that parsing     //
+//  overlaps with prediction                              //
+//========================================================//
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include "trace.h"
+
+class PipelinedReader : public TraceReader
+{
+public:
+  PipelinedReader(TraceReader *inner);
+  ~PipelinedReader();
+  int next(branch_t *br);
+  size_t next_batch(branch_batch_t *b);
+
+private:
+  TraceReader *inner;
+  branch_batch_t *ring;
+
+  // Batches [tail, head) are full and waiting for the consumer.
+  // Only the producer writes head and only the consumer writes tail.
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+  std::atomic<int> done; // producer has pushed its last batch
+  std::atomic<int> stop; // consumer is going away
+
+  // Consumer's position in the batch at 'tail'
+  const branch_batch_t *cur;
+  size_t pos;
+
+  std::thread producer;
+  void produce();
+  int advance();
+};
+
+PipelinedReader::PipelinedReader(TraceReader *inner)
+    : inner(inner), head(0), tail(0), done(0), stop(0), cur(NULL), pos(0)
+{
+  ring = new branch_batch_t[PIPE_DEPTH];
+  producer = std::thread(&PipelinedReader::produce, this);
+}
+
+PipelinedReader::~PipelinedReader()
+{
+  stop.store(1);
+  producer.join();
+  delete[] ring;
+  delete inner;
+}
+
+void PipelinedReader::produce()
+{
+  size_t h = 0;
+  int more = 1;
+  while (more)
+  {
+    // Wait for a free slot
+    while (h - tail.load(std::memory_order_acquire) == PIPE_DEPTH)
+    {
+      if (stop.load(std::memory_order_relaxed))
+        return;
+      std::this_thread::yield();
+    }
+
+    // Read until the inner reader says the trace has ended: a short
+    // batch may not be the last, and a reader may act on the end, as
+    // CachingReader does when it publishes its copy
+    size_t n = inner->next_batch(&ring[h % PIPE_DEPTH]);
+    if (n)
+      head.store(++h, std::memory_order_release);
+    more = (n != 0);
+  }
+  done.store(1, std::memory_order_release);
+}
+
+// Move on to the next full batch
+//
+// Returns False at the end of the trace
+//
+int PipelinedReader::advance()
+{
+  // Hand the finished batch back to the producer
+  size_t t = tail.load(std::memory_order_relaxed);
+  if (cur)
+  {
+    tail.store(++t, std::memory_order_release);
+    cur = NULL;
+  }
+
+  while (head.load(std::memory_order_acquire) == t)
+  {
+    if (done.load(std::memory_order_acquire) && head.load(std::memory_order_acquire) == t)
+      return 0;
+    std::this_thread::yield();
+  }
+
+  cur = &ring[t % PIPE_DEPTH];
+  pos = 0;
+  return 1;
+}
+
+int PipelinedReader::next(branch_t *br)
+{
+  if (!(cur && pos < cur->count) && !advance())
+    return 0;
+
+  br->pc = cur->pc[pos];
+  br->target = cur->target[pos];
+  unpack_flags(cur->flags[pos], br);
+  pos++;
+  return 1;
+}
+
+size_t PipelinedReader::next_batch(branch_batch_t *b)
+{
+  if (!(cur && pos < cur->count) && !advance())
+    return 0;
+
+  size_t n = cur->count - pos;
+  memcpy(b->pc, cur->pc + pos, n * sizeof(uint32_t));
+  memcpy(b->target, cur->target + pos, n * sizeof(uint32_t));
+  memcpy(b->flags, cur->flags + pos, n * sizeof(uint8_t));
+  b->count = n;
+  pos = cur->count;
+  return n;
+}
+
+TraceReader *trace_pipeline(TraceReader *inner)
+{
+  return new PipelinedReader(inner);
+}
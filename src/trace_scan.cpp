@@ -0,0 +1,191 @@
+//========================================================//
+//  trace_scan.cpp                                        //
+//  Vectorized scanner for the text trace format          //
+//                                                        //
+//  Classifies a window of the chunk at a time with       //
+//  AVX-512 or AVX2, then reads the canonical lines off   //
+//  the resulting bitmap with 64-bit word arithmetic.     //
+//========================================================//
+#include <string.h>
+#include <immintrin.h>
+#include "trace.h"
+
+// Bytes classified per pass
+#define SCAN_WINDOW 4096
+
+// Longest canonical line: 0x<8>\t0x<8>\t<1>\t<1>\t<1>\t<1>\t<1>\n
+#define SCAN_MAX_LINE 32
+
+static inline uint64_t load64(const char *p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+//------------------------------------//
+//          Classification            //
+//------------------------------------//
+
+// Each fills hex[] with one bit per byte of p[0..len), set for the
+// bytes that are hex digits, and clears the two words after the last
+
+__attribute__((target("avx512bw"))) static void classify_avx512(const char *p, size_t len, uint64_t *hex)
+{
+  const __m512i zero = _mm512_set1_epi8('0');
+  const __m512i a = _mm512_set1_epi8('a');
+  const __m512i lower = _mm512_set1_epi8(0x20);
+  const __m512i nine = _mm512_set1_epi8(9);
+  const __m512i five = _mm512_set1_epi8(5);
+
+  size_t w = 0;
+  for (size_t i = 0; i < len; i += 64, w++)
+  {
+    __mmask64 m = len - i >= 64 ? ~0ull : (1ull << (len - i)) - 1;
+    __m512i c = _mm512_maskz_loadu_epi8(m, p + i);
+    __mmask64 digit = _mm512_cmple_epu8_mask(_mm512_sub_epi8(c, zero), nine);
+    __mmask64 letter = _mm512_cmple_epu8_mask(_mm512_sub_epi8(_mm512_or_si512(c, lower), a), five);
+    hex[w] = (digit | letter) & m;
+  }
+  hex[w] = hex[w + 1] = 0;
+}
+
+__attribute__((target("avx2"))) static inline uint32_t hex_mask_avx2(__m256i c)
+{
+  __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+  __m256i l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+
+  // Unsigned x <= n as min(x, n) == x
+  __m256i digit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+  __m256i letter = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+  return (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(digit, letter));
+}
+
+__attribute__((target("avx2"))) static void classify_avx2(const char *p, size_t len, uint64_t *hex)
+{
+  size_t w = 0;
+  for (size_t i = 0; i < len; i += 64, w++)
+  {
+    const char *q = p + i;
+    char tail[64];
+    if (len - i < 64)
+    {
+      // The end of the window may be the end of the mapping
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, q, len - i);
+      q = tail;
+    }
+    __m256i lo = _mm256_loadu_si256((const __m256i *)q);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(q + 32));
+    hex[w] = hex_mask_avx2(lo) | (uint64_t)hex_mask_avx2(hi) << 32;
+  }
+  hex[w] = hex[w + 1] = 0;
+}
+
+//------------------------------------//
+//            Line Parser             //
+//------------------------------------//
+
+// Number of consecutive hex digits at bit 'pos' of the bitmap
+//
+static inline int hex_run(const uint64_t *hex, size_t pos)
+{
+  size_t w = pos >> 6;
+  int s = pos & 63;
+  uint64_t bits = s ? (hex[w] >> s) | (hex[w + 1] << (64 - s)) : hex[w];
+  return ~bits ? __builtin_ctzll(~bits) : 64;
+}
+
+// Value of the 'len' (1 to 8) hex digits at 'p'
+//
+static inline uint32_t hex_value(const char *p, int len)
+{
+  // Drop the bytes past the field and put the last digit in byte 0
+  uint64_t w = __builtin_bswap64(load64(p) << (8 * (8 - len)));
+
+  // Digit to nibble: the low 4 bits, plus 9 for a letter
+  w = (w & 0x0F0F0F0F0F0F0F0Full) + 9 * ((w >> 6) & 0x0101010101010101ull);
+
+  // Gather the nibbles
+  w = (w | (w >> 4)) & 0x00FF00FF00FF00FFull;
+  w = (w | (w >> 8)) & 0x0000FFFF0000FFFFull;
+  w = (w | (w >> 16)) & 0xFFFFFFFFull;
+  return (uint32_t)w;
+}
+
+// Parse lines of the form 0x<hex>\t0x<hex>\t<d>\t<d>\t<d>\t<d>\t<d>\n,
+// with 1 to 8 hex digits and each d 0 or 1. Any other line is left to
+// parse_branch_line(), which gives these lines the same values.
+//
+template <void (*CLASSIFY)(const char *, size_t, uint64_t *)>
+static size_t scan_lines(const char **pp, const char *end, branch_batch_t *b, size_t n)
+{
+  uint64_t hex[SCAN_WINDOW / 64 + 2];
+  const char *p = *pp;
+  const char *base = p;
+  const char *limit = p;
+
+  while (n < BATCH_SIZE)
+  {
+    // Every byte a line may touch must be classified and in the chunk
+    if (limit - p < SCAN_MAX_LINE)
+    {
+      if (end - p < SCAN_MAX_LINE)
+        break;
+      size_t len = end - p < SCAN_WINDOW ? end - p : SCAN_WINDOW;
+      CLASSIFY(p, len, hex);
+      base = p;
+      limit = p + len;
+    }
+
+    // Each hex field ends at its tab
+    size_t s = p - base;
+    if (p[0] != '0' || (p[1] | 0x20) != 'x')
+      break;
+    int len1 = hex_run(hex, s + 2);
+    const char *tab1 = p + 2 + len1;
+    if (len1 == 0 || len1 > 8 || tab1[0] != '\t' || tab1[1] != '0' || (tab1[2] | 0x20) != 'x')
+      break;
+    int len2 = hex_run(hex, s + 5 + len1);
+    const char *tab2 = tab1 + 3 + len2;
+    if (len2 == 0 || len2 > 8)
+      break;
+
+    // The five flags: '\t' then '0' or '1', five times, then '\n'
+    uint64_t f = load64(tab2);
+    uint16_t g;
+    memcpy(&g, tab2 + 8, 2);
+    if ((f & 0xFEFFFEFFFEFFFEFFull) != 0x3009300930093009ull || (g & 0xFEFF) != 0x3009 ||
+        tab2[10] != '\n')
+      break;
+
+    b->pc[n] = hex_value(p + 2, len1);
+    b->target[n] = hex_value(tab1 + 3, len2);
+    b->flags[n] = ((f >> 8) & BR_TAKEN) | ((f >> 23) & BR_COND) | ((f >> 38) & BR_CALL) |
+                  ((f >> 53) & BR_RET) | ((g >> 4) & BR_DIRECT);
+    n++;
+    p = tab2 + 11;
+  }
+
+  *pp = p;
+  return n;
+}
+
+//------------------------------------//
+//             Interface              //
+//------------------------------------//
+
+text_scan_fn text_scanner()
+{
+  // BP_TRACE_SCAN=avx2 or =scalar caps the instruction set used
+  const char *cap = getenv("BP_TRACE_SCAN");
+  int allow512 = !cap || !strcmp(cap, "avx512");
+  int allow256 = allow512 || !strcmp(cap, "avx2");
+
+  __builtin_cpu_init();
+  if (allow512 && __builtin_cpu_supports("avx512bw"))
+    return scan_lines<classify_avx512>;
+  if (allow256 && __builtin_cpu_supports("avx2"))
+    return scan_lines<classify_avx2>;
+  return NULL;
+}
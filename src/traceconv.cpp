@@ -0,0 +1,126 @@
+//========================================================//
+//  traceconv.cpp                                         //
+//  Converts text traces into the binary or compact       //
+//  trace formats, and writes trace indexes               //
+//========================================================//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+// Print out the Usage information to stderr
+//
+void usage()
+{
+  fprintf(stderr, "Usage: traceconv <options> <input> <output>\n");
+  fprintf(stderr, "       traceconv --index <trace>\n");
+  fprintf(stderr, " <input> is a text trace (plain, bzip2, zstd or lz4), or - for standard input\n");
+  fprintf(stderr, " Options:\n");
+  fprintf(stderr, " --help          Print this message\n");
+  fprintf(stderr, " --meta=<file>   Trace metadata (default: <input> with a .txt extension)\n");
+  fprintf(stderr, " --compact      Write the dictionary/varint compact format\n");
+  fprintf(stderr, " --index        Write <trace>.idx for seeking in a text trace\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *meta_path = NULL;
+  int compact = 0;
+  int index = 0;
+  const char *files[2];
+  int nfiles = 0;
+
+  // Process cmdline Arguments
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "--help"))
+    {
+      usage();
+      exit(0);
+    }
+    else if (!strcmp(argv[i], "--compact"))
+    {
+      compact = 1;
+    }
+    else if (!strcmp(argv[i], "--index"))
+    {
+      index = 1;
+    }
+    else if (!strncmp(argv[i], "--meta=", 7))
+    {
+      meta_path = argv[i] + 7;
+    }
+    else if (!strncmp(argv[i], "--", 2) || nfiles == 2)
+    {
+      printf("Unrecognized option %s\n", argv[i]);
+      usage();
+      exit(1);
+    }
+    else
+    {
+      files[nfiles++] = argv[i];
+    }
+  }
+  if (nfiles != (index ? 1 : 2))
+  {
+    usage();
+    exit(1);
+  }
+
+  if (index)
+  {
+    char *idx_path = (char *)malloc(strlen(files[0]) + 5);
+    sprintf(idx_path, "%s.idx", files[0]);
+    int64_t n = trace_index_build(files[0], idx_path);
+    if (n < 0)
+    {
+      fprintf(stderr, "Failed to index %s\n", files[0]);
+      exit(1);
+    }
+    printf("Checkpoints:     %10lld\n", (long long)n);
+    free(idx_path);
+    return 0;
+  }
+
+  // Metadata is optional; without it the header carries zeros
+  trace_meta_t meta;
+  memset(&meta, 0, sizeof(meta));
+  if (meta_path)
+  {
+    if (!trace_read_meta(meta_path, &meta))
+    {
+      fprintf(stderr, "Unable to read metadata %s\n", meta_path);
+      exit(1);
+    }
+  }
+  else if (strcmp(files[0], "-") != 0 && !trace_find_meta(files[0], &meta))
+  {
+    fprintf(stderr, "Warning: no metadata found for %s\n", files[0]);
+  }
+
+  TraceReader *in = strcmp(files[0], "-") ? trace_open_file(files[0]) : trace_open(stdin);
+  if (!in)
+  {
+    fprintf(stderr, "Unable to open trace %s\n", files[0]);
+    exit(1);
+  }
+  FILE *out = fopen(files[1], "wb");
+  if (!out)
+  {
+    fprintf(stderr, "Unable to create %s\n", files[1]);
+    exit(1);
+  }
+
+  int64_t n = compact ? ctrace_write(in, out, &meta) : btrace_write(in, out, &meta);
+  delete in;
+  if (fclose(out) != 0 || n < 0)
+  {
+    fprintf(stderr, "Failed to write %s\n", files[1]);
+    remove(files[1]);
+    exit(1);
+  }
+
+  printf("Records:         %10lld\n", (long long)n);
+  return 0;
+}